@@ -0,0 +1,142 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Records the packets of a workload and replays them, against the real keyboard or the
+// simulator. Replays print the acknowledgement latency of the capture and of the replay as one
+// JSON object per line, in microseconds.
+//
+//   capture record setup.cap setup
+//   capture replay setup.cap --fast
+
+#include "capture.hpp"
+#include "simulator.hpp"
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fmt/format.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace mfk;
+
+std::unique_ptr<Transport> open_transport(bool simulated) {
+  if (simulated) return std::make_unique<SimulatedX50Q>();
+  auto devices = X50Q::enumerate();
+  if (devices.empty()) throw std::runtime_error("No keyboard found");
+  return std::make_unique<UsbTransport>(UsbTransport::open_reports(devices.front().hid_path),
+                                        std::move(devices.front().usb));
+}
+
+void run_workload(X50Q &dev, std::string_view workload, int frames) {
+  if (workload == "setup") {
+    dev.setup();
+  } else if (workload == "frames") {
+    std::uint8_t colors[3][144] = {};
+    for (int frame = 0; frame != frames; ++frame) {
+      for (int key = 0; key != 144; ++key) {
+        colors[0][key] = std::uint8_t(key + frame);
+        colors[1][key] = std::uint8_t(2 * key + frame);
+        colors[2][key] = std::uint8_t(3 * key - frame);
+      }
+      dev.apply_colors_idle(colors);
+    }
+  } else {
+    throw std::runtime_error(fmt::format("Unknown workload {}", workload));
+  }
+}
+
+void report(std::string_view name, std::string_view pacing,
+            std::vector<std::chrono::microseconds> samples, std::chrono::microseconds duration) {
+  std::ranges::sort(samples);
+  auto percentile = [&](double p) {
+    return samples.empty()
+               ? 0
+               : samples[std::min(samples.size() - 1, std::size_t(p * samples.size()))].count();
+  };
+  std::chrono::microseconds total{};
+  for (auto sample : samples)
+    total += sample;
+  fmt::print("{{\"run\":\"{}\",\"pacing\":\"{}\",\"samples\":{},\"mean\":{:.1f},\"p50\":{},"
+             "\"p90\":{},\"p99\":{},\"max\":{},\"duration\":{}}}\n",
+             name, pacing, samples.size(),
+             samples.empty() ? 0. : double(total.count()) / samples.size(), percentile(.5),
+             percentile(.9), percentile(.99), samples.empty() ? 0 : samples.back().count(),
+             duration.count());
+}
+
+void dump(const std::vector<Capture::Record> &records) {
+  for (auto &record : records) {
+    auto data = record.data();
+    // Output packets are padded with zeros
+    auto end =
+        std::find_if(data.rbegin(), data.rend(), [](std::byte b) { return b != std::byte(); });
+    fmt::print("{:10} {} ", record.time.count(),
+               record.direction == Capture::Direction::Out ? "out" : "in ");
+    for (auto it = data.begin(); it != end.base(); ++it)
+      fmt::print(" {:02x}", std::uint8_t(*it));
+    fmt::print("\n");
+  }
+}
+
+int main(int argc, char *argv[]) try {
+  std::vector<std::string_view> args(argv + 1, argv + argc);
+  auto flag = [&](std::string_view name) {
+    auto it = std::ranges::find(args, name);
+    if (it == args.end()) return false;
+    args.erase(it);
+    return true;
+  };
+  const bool simulated = flag("--simulated");
+  const bool fast      = flag("--fast");
+  if (args.size() >= 3 && args[0] == "record" && args.size() <= 4) {
+    auto capture = std::make_shared<CaptureWriter>(std::string(args[1]));
+    X50Q dev(std::make_unique<RecordingTransport>(open_transport(simulated), capture));
+    run_workload(dev, args[2], args.size() == 4 ? std::stoi(std::string(args[3])) : 100);
+    capture->flush();
+  } else if (args.size() == 2 && args[0] == "replay") {
+    auto records   = Capture::load(std::string(args[1]));
+    auto transport = open_transport(simulated);
+    auto pacing    = fast ? "fast" : "original";
+    auto stats     = replay(*transport, records, fast ? Pacing::Fast : Pacing::Original);
+    report("recorded", pacing, std::move(stats.recorded), stats.recorded_duration);
+    report("replayed", pacing, std::move(stats.replayed), stats.replayed_duration);
+  } else if (args.size() == 2 && args[0] == "dump") {
+    dump(Capture::load(std::string(args[1])));
+  } else {
+    fmt::print("Usage: {0} record FILE (setup | frames [COUNT]) [--simulated]\n"
+               "       {0} replay FILE [--fast] [--simulated]\n"
+               "       {0} dump FILE\n",
+               argv[0]);
+    return -1;
+  }
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return -1;
+}
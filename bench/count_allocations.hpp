@@ -0,0 +1,73 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Replaces the global allocation functions to count heap allocations, for the benchmarks and
+// tests which check that the steady state doesn't allocate. Include it in a single translation
+// unit of the program.
+
+#ifndef X50Q_COUNT_ALLOCATIONS_HPP
+#define X50Q_COUNT_ALLOCATIONS_HPP
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+inline std::atomic<std::uint64_t> allocations = 0;
+
+inline void *count_allocation(std::size_t size,
+                              std::size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  // aligned_alloc wants a multiple of the alignment
+  size = (std::max<std::size_t>(size, 1) + alignment - 1) / alignment * alignment;
+  if (auto ptr = std::aligned_alloc(alignment, size)) return ptr;
+  throw std::bad_alloc();
+}
+// Not inlined, otherwise GCC sees free() on memory from operator new (-Wmismatched-new-delete).
+[[gnu::noinline]] inline void release_allocation(void *ptr) noexcept { std::free(ptr); }
+
+// Every form, so neither arrays nor over-aligned types get past the counter.
+void *operator new(std::size_t size) { return count_allocation(size); }
+void *operator new[](std::size_t size) { return count_allocation(size); }
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return count_allocation(size, std::size_t(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return count_allocation(size, std::size_t(alignment));
+}
+void operator delete(void *ptr) noexcept { release_allocation(ptr); }
+void operator delete[](void *ptr) noexcept { release_allocation(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { release_allocation(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { release_allocation(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { release_allocation(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { release_allocation(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  release_allocation(ptr);
+}
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  release_allocation(ptr);
+}
+#endif
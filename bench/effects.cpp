@@ -0,0 +1,118 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures the effect kernels with every vector width the compiler targets. Every measurement is
+// printed as one JSON object per line, times are in nanoseconds per frame.
+
+#include "color.hpp"
+#include "effects.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <string_view>
+#include <vector>
+
+using namespace mfk;
+using namespace mfk::effects;
+using clock_type = std::chrono::steady_clock;
+
+// Every sample renders this many frames, a single one is too fast for the clock.
+constexpr int frames_per_sample = 100;
+
+std::uint8_t colors[3][144];
+volatile std::uint8_t sink;
+
+template <typename F> void measure(std::string_view backend, std::string_view kernel,
+                                   int samples, F &&f) {
+  std::vector<double> result;
+  result.reserve(samples);
+  for (int i = 0; i != samples; ++i) {
+    auto start = clock_type::now();
+    for (int frame = 0; frame != frames_per_sample; ++frame)
+      f(float(i * frames_per_sample + frame) / 60);
+    auto elapsed = clock_type::now() - start;
+    result.push_back(std::chrono::duration<double, std::nano>(elapsed).count() /
+                     frames_per_sample);
+    sink = colors[i % 3][i % 144];
+  }
+  std::ranges::sort(result);
+  double total = 0;
+  for (auto sample : result)
+    total += sample;
+  auto percentile = [&](double p) {
+    return result[std::min(result.size() - 1, std::size_t(p * result.size()))];
+  };
+  fmt::print("{{\"backend\":\"{}\",\"kernel\":\"{}\",\"samples\":{},\"mean\":{:.1f},"
+             "\"p50\":{:.1f},\"p99\":{:.1f},\"max\":{:.1f}}}\n",
+             backend, kernel, samples, total / samples, percentile(.5), percentile(.99),
+             result.back());
+}
+
+template <class V> void run(int samples) {
+  const auto &geometry = us_geometry;
+  measure(V::name, "linear_gradient", samples, [&](float t) {
+    linear_gradient<V>(colors, geometry, {0, 0}, {22, t}, {255, 0, 0}, {0, 0, 255});
+  });
+  measure(V::name, "radial_gradient", samples, [&](float t) {
+    radial_gradient<V>(colors, geometry, {11, 3}, 5 + t, {255, 255, 255}, {0, 0, 32});
+  });
+  measure(V::name, "wave", samples, [&](float t) {
+    wave<V>(colors, geometry, {1, .3f}, 8, t, {255, 0, 0}, {0, 255, 0});
+  });
+  measure(V::name, "plasma", samples, [&](float t) { plasma<V>(colors, geometry, t); });
+  measure(V::name, "ripple", samples, [&](float t) {
+    ripple<V>(colors, geometry, {5, 3}, t, 1.5f, {255, 255, 0}, {0, 0, 0});
+  });
+  measure(V::name, "rainbow", samples, [&](float t) { rainbow<V>(colors, geometry, t); });
+}
+
+int main(int argc, char *argv[]) {
+  int samples = 1000;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--samples" && i + 1 < argc)
+      samples = std::max(1, std::atoi(argv[++i]));
+    else {
+      fmt::print(stderr, "Usage: {} [--samples N]\n", argv[0]);
+      return -1;
+    }
+  }
+
+  run<simd::Scalar>(samples);
+#ifdef __SSE2__
+  run<simd::Sse2>(samples);
+#endif
+#ifdef __AVX2__
+  run<simd::Avx2>(samples);
+#endif
+
+  ColorCorrection correction;
+  correction.set_scale(36, .5f);
+  measure(simd::Native::name, "color_correction", samples,
+          [&](float) { correction.apply(colors); });
+  return 0;
+}
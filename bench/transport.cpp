@@ -0,0 +1,214 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures how fast the keyboard can be driven, against the simulator and (if connected) the
+// real keyboard. Every measurement is printed as one JSON object per line. Latencies are in
+// microseconds. allocations is the number of heap allocations per operation, without the first
+// one (which may still grow buffers); it should be zero for everything but setup.
+
+#include "../profile/profile.hpp"
+#include "count_allocations.hpp"
+#include "simulator.hpp"
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/format.h>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+using namespace mfk;
+using clock_type = std::chrono::steady_clock;
+
+struct Options {
+  int samples    = 200;
+  bool simulator = true;
+  bool device    = true;
+  bool setup     = true;
+};
+
+struct Measurement {
+  std::vector<clock_type::duration> samples;
+  double allocations; // Per sample, without the first one
+};
+
+void report(std::string_view target, std::string_view operation,
+            std::vector<clock_type::duration> samples, double fps = 0,
+            std::optional<double> allocations = {}) {
+  std::ranges::sort(samples);
+  auto us = [](clock_type::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+  };
+  auto percentile = [&](double p) {
+    return us(samples[std::min(samples.size() - 1, std::size_t(p * samples.size()))]);
+  };
+  clock_type::duration total{};
+  for (auto sample : samples)
+    total += sample;
+  auto mean = us(total) / samples.size();
+  fmt::print("{{\"target\":\"{}\",\"operation\":\"{}\",\"samples\":{},\"mean\":{:.1f},"
+             "\"p50\":{:.1f},\"p90\":{:.1f},\"p99\":{:.1f},\"max\":{:.1f}",
+             target, operation, samples.size(), mean, percentile(.5), percentile(.9),
+             percentile(.99), us(samples.back()));
+  if (fps) fmt::print(",\"fps\":{:.1f}", fps);
+  if (allocations) fmt::print(",\"allocations\":{:.2f}", *allocations);
+  fmt::print("}}\n");
+}
+void report(std::string_view target, std::string_view operation, Measurement measurement,
+            double fps = 0) {
+  report(target, operation, std::move(measurement.samples), fps, measurement.allocations);
+}
+
+template <typename F> Measurement measure(int samples, F &&f) {
+  Measurement result;
+  result.samples.reserve(samples);
+  std::uint64_t allocated = 0;
+  for (int i = 0; i != samples; ++i) {
+    auto before = allocations.load(std::memory_order_relaxed);
+    auto start  = clock_type::now();
+    f(i);
+    result.samples.push_back(clock_type::now() - start);
+    if (i) allocated += allocations.load(std::memory_order_relaxed) - before;
+  }
+  result.allocations = samples > 1 ? double(allocated) / (samples - 1) : 0;
+  return result;
+}
+
+void run(std::string_view target, X50Q &dev, const Options &options) {
+  auto samples = options.samples;
+
+  report(target, "status", measure(samples, [&](int) { dev.status(); }));
+
+  // A single block is exactly one exchange_block
+  std::array<X50Q::Effect, 144> effects = {};
+  report(target, "exchange_block", measure(samples, [&](int) {
+           dev.apply_blocks(X50Q::Table::EffectsIdle, as_bytes(std::span(effects)),
+                            X50Q::BlockMask(1));
+         }));
+
+  std::uint8_t colors[3][144] = {};
+  auto frames                 = measure(samples, [&](int i) {
+    colors[i % 3][i % 144] = i;
+    dev.apply_colors_idle(colors);
+  });
+  clock_type::duration total{};
+  for (auto frame : frames.samples)
+    total += frame;
+  report(target, "apply_colors_idle", frames,
+         samples / std::chrono::duration<double>(total).count());
+
+  // The same frames, written straight into the packets
+  X50Q::Framebuffer framebuffer(X50Q::Table::ColorsIdle);
+  report(target, "apply_framebuffer", measure(samples, [&](int i) {
+           framebuffer[i % 3][i % 144] = i;
+           dev.apply(framebuffer);
+         }));
+
+  // Queue all frames at once, such that the blocks of consecutive frames get pipelined too.
+  auto start = clock_type::now();
+  for (int i = 0; i != samples; ++i) {
+    colors[i % 3][i % 144] = i;
+    dev.apply_colors_idle_async(colors, {});
+  }
+  dev.flush();
+  auto elapsed = clock_type::now() - start;
+  report(target, "apply_colors_idle_async", {elapsed / samples},
+         samples / std::chrono::duration<double>(elapsed).count());
+
+  Profile profile = {};
+  report(target, "profile_apply",
+         measure(std::max(1, samples / 10), [&](int) { profile.apply(dev); }));
+
+  if (options.setup) report(target, "setup", measure(3, [&](int) { dev.setup(); }));
+}
+
+int main(int argc, char *argv[]) try {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (arg == "--no-simulator")
+      options.simulator = false;
+    else if (arg == "--no-device")
+      options.device = false;
+    else if (arg == "--no-setup")
+      options.setup = false;
+    else if (arg == "--samples" && i + 1 < argc)
+      options.samples = std::max(1, std::atoi(argv[++i]));
+    else {
+      fmt::print(stderr,
+                 "Usage: {} [--samples N] [--no-simulator] [--no-device] [--no-setup]\n",
+                 argv[0]);
+      return -1;
+    }
+  }
+
+  if (options.simulator) {
+    auto simulator = std::make_unique<SimulatedX50Q>();
+    auto &keyboard = *simulator;
+    X50Q dev(std::move(simulator));
+    run("simulated", dev, options);
+
+    // From the report of the keyboard until the callback ran
+    int changes = 0;
+    dev.on_profile_change([&](std::uint8_t) { ++changes; });
+    report("simulated", "event", measure(options.samples, [&](int i) {
+             keyboard.press_profile_key(i % 6 + 1);
+             while (changes == i)
+               dev.poll(std::chrono::milliseconds(1));
+           }));
+  }
+  if (options.device) {
+    std::optional<X50Q> dev;
+    // The first open includes initializing hidapi and libusb, like every short-lived tool does.
+    auto start = clock_type::now();
+    try {
+      dev.emplace();
+    } catch (const std::exception &ex) {
+      fmt::print(stderr, "Skipping keyboard: {}\n", ex.what());
+    }
+    if (dev) {
+      report("device", "first_open", {clock_type::now() - start});
+      auto state = dev->status();
+      run("device", *dev, options);
+      dev->set_builtin(state.profile);
+      dev.reset();
+
+      auto opens = std::max(1, options.samples / 10);
+      report("device", "open_enumerate",
+             measure(opens, [](int) { X50Q dev(X50Q::enumerate().front()); }));
+      // Validates the discovery cache written by the first open
+      report("device", "open_cached", measure(opens, [](int) { X50Q dev; }));
+    }
+  }
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return -1;
+}
@@ -0,0 +1,325 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// x50qd owns the keyboard and executes the commands of its clients one after another. See
+// x50qd.hpp for the protocol.
+
+#include "shadow.hpp"
+#include "x50q.hpp"
+#include "x50qd.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <limits>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+using namespace mfk;
+using namespace mfk::x50qd;
+
+namespace {
+volatile std::sig_atomic_t stopped = false;
+
+struct Connection {
+  int fd;
+  bool subscribed = false;
+};
+
+// A request which changed the shadow state. It gets its reply after the next commit.
+struct Pending {
+  int fd;
+  Command command;
+};
+
+bool is_color_table(std::byte table) {
+  return table == std::byte(X50Q::Table::ColorsIdle) ||
+         table == std::byte(X50Q::Table::ColorsActive);
+}
+
+class Daemon {
+  X50Q device;
+  ShadowState shadow{device};
+  int listener;
+  std::vector<Connection> clients;
+  std::vector<Pending> pending;
+  // Clients which didn't take a message. They would miss replies, so they get disconnected.
+  std::vector<int> unresponsive;
+  // The keyboard's file descriptor after it reported an error, ignored until the next reconnect
+  int dropped                     = -1;
+  std::uint64_t dropped_reconnect = 0;
+
+  // Never blocks: a single client which doesn't read must not stall everyone else.
+  void send(int fd, std::span<const std::byte> message) {
+    if (::send(fd, message.data(), message.size(), MSG_NOSIGNAL | MSG_DONTWAIT) ==
+        ssize_t(message.size()))
+      return;
+    if (std::ranges::find(unresponsive, fd) == unresponsive.end()) unresponsive.push_back(fd);
+  }
+
+  void reply(int fd, Command command, Error error = Error::None,
+             std::span<const std::byte> payload = {}) {
+    std::byte message[2 + 256];
+    message[0] = std::byte(command);
+    message[1] = std::byte(error);
+    payload    = payload.first(std::min<std::size_t>(payload.size(), 256));
+    std::ranges::copy(payload, message + 2);
+    send(fd, std::span(message, 2 + payload.size()));
+  }
+
+  void reply_error(int fd, Command command, const std::exception &ex) {
+    reply(fd, command, Error::Keyboard, std::as_bytes(std::span(std::string_view(ex.what()))));
+  }
+
+  void broadcast(Event event, std::uint8_t value) {
+    const std::byte message[] = {std::byte(event), std::byte(value)};
+    for (auto &client : clients)
+      if (client.subscribed) send(client.fd, message);
+  }
+
+  void disconnect(int fd) {
+    auto client = std::ranges::find(clients, fd, &Connection::fd);
+    if (client == clients.end()) return; // Already gone
+    std::erase_if(pending, [&](auto &request) { return request.fd == fd; });
+    clients.erase(client);
+    ::close(fd);
+  }
+
+  // How long poll() may sleep: until the keyboard needs attention even if it stays quiet.
+  int timeout(int keyboard) const {
+    // Without a file descriptor, the keyboard can only be polled.
+    std::int64_t milliseconds = keyboard < 0 ? 10 : std::numeric_limits<int>::max();
+    if (auto deadline = device.next_deadline()) {
+      auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+          *deadline - std::chrono::steady_clock::now());
+      milliseconds = std::clamp<std::int64_t>(remaining.count(), 0, milliseconds);
+    }
+    return milliseconds == std::numeric_limits<int>::max() ? -1 : int(milliseconds);
+  }
+
+  // Upload everything changed by the requests read so far and answer them.
+  void commit() {
+    if (pending.empty()) return;
+    std::exception_ptr error;
+    try {
+      shadow.commit();
+    } catch (...) { error = std::current_exception(); }
+    for (auto &request : pending) {
+      if (!error) {
+        reply(request.fd, request.command);
+        continue;
+      }
+      try {
+        std::rethrow_exception(error);
+      } catch (const std::exception &ex) { reply_error(request.fd, request.command, ex); }
+    }
+    pending.clear();
+  }
+
+  // Execute a single request. Changes of the tables are only collected, such that a burst of
+  // requests gets uploaded as one.
+  void handle(Connection &client, std::span<const std::byte> message) {
+    auto command = Command(message[0]);
+    auto payload = message.subspan(1);
+    auto &tables = shadow.tables();
+    switch (command) {
+    case Command::SetKey: {
+      if (payload.size() != 5 || !is_color_table(payload[0]) || std::uint8_t(payload[1]) >= 144)
+        break;
+      auto &colors = X50Q::Table(payload[0]) == X50Q::Table::ColorsIdle ? tables.colors_idle
+                                                                          : tables.colors_active;
+      for (int i = 0; i != 3; ++i)
+        colors[i][std::uint8_t(payload[1])] = std::uint8_t(payload[2 + i]);
+      pending.push_back({client.fd, command});
+      return;
+    }
+    case Command::SetFrame: {
+      if (payload.size() != 1 + 3 * 144 || !is_color_table(payload[0])) break;
+      auto &colors = X50Q::Table(payload[0]) == X50Q::Table::ColorsIdle ? tables.colors_idle
+                                                                          : tables.colors_active;
+      std::memcpy(colors, payload.data() + 1, sizeof colors);
+      pending.push_back({client.fd, command});
+      return;
+    }
+    case Command::ApplyTables:
+      if (payload.size() != sizeof tables) break;
+      std::memcpy(&tables, payload.data(), sizeof tables);
+      pending.push_back({client.fd, command});
+      return;
+    case Command::SetBuiltin:
+    case Command::Status:
+      if (payload.size() != (command == Command::SetBuiltin)) break;
+      if (command == Command::SetBuiltin &&
+          (payload[0] == std::byte() || std::uint8_t(payload[0]) > 6))
+        break;
+      // Keep the order: Earlier changes have to reach the keyboard first.
+      commit();
+      try {
+        if (command == Command::Status) {
+          auto status = device.status();
+          reply(client.fd, command, Error::None, std::as_bytes(std::span(&status, 1)));
+        } else {
+          device.set_builtin(std::uint8_t(payload[0]));
+          shadow.invalidate();
+          reply(client.fd, command);
+        }
+      } catch (const std::exception &ex) { reply_error(client.fd, command, ex); }
+      return;
+    case Command::Subscribe:
+      if (!payload.empty()) break;
+      client.subscribed = true;
+      reply(client.fd, command);
+      return;
+    case Command::Invalidate:
+      if (!payload.empty()) break;
+      // Nothing to upload yet, the next commit sends every block.
+      shadow.invalidate();
+      reply(client.fd, command);
+      return;
+    }
+    reply(client.fd, command, Error::Invalid);
+  }
+
+  // Read everything the client sent so far. Returns false once the connection is closed.
+  bool receive(Connection &client) {
+    std::byte message[max_message + 1];
+    while (true) {
+      auto length = ::recv(client.fd, message, sizeof message, MSG_DONTWAIT);
+      if (length < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      if (length == 0) return false;
+      handle(client, std::span(message, length));
+    }
+  }
+
+ public:
+  explicit Daemon(int listener): listener(listener) {
+    shadow.restore_on_reconnect();
+    device.on_profile_change([this](std::uint8_t profile) {
+      // Switching profiles on the keyboard replaces what we uploaded
+      shadow.invalidate();
+      broadcast(Event::ProfileChange, profile);
+    });
+    device.on_volume_key([this](bool up) { broadcast(Event::VolumeKey, up); });
+  }
+
+  void run() {
+    std::vector<pollfd> fds;
+    while (!stopped) {
+      // Changes whenever the keyboard gets reopened
+      int keyboard = device.transport().fd();
+      if (dropped >= 0 && device.statistics().reconnects != dropped_reconnect) dropped = -1;
+      if (keyboard == dropped) keyboard = -1;
+      fds.assign(1, {listener, POLLIN, 0});
+      if (keyboard >= 0) fds.push_back({keyboard, POLLIN, 0});
+      const std::size_t first_client = fds.size();
+      for (auto &client : clients)
+        fds.push_back({client.fd, POLLIN, 0});
+      if (::poll(fds.data(), fds.size(), timeout(keyboard)) < 0 && errno != EINTR)
+        throw std::system_error(errno, std::generic_category(), "poll");
+
+      if (fds[0].revents & POLLIN) {
+        int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) clients.push_back({fd});
+      }
+      // A vanished hidraw node stays readable, so it is ignored until the keyboard is reopened.
+      if (keyboard >= 0 && (fds[1].revents & (POLLERR | POLLHUP))) {
+        dropped           = keyboard;
+        dropped_reconnect = device.statistics().reconnects;
+      }
+      for (std::size_t i = first_client; i != fds.size(); ++i) {
+        if (!fds[i].revents) continue;
+        auto client = std::ranges::find(clients, fds[i].fd, &Connection::fd);
+        if (!receive(*client)) disconnect(fds[i].fd);
+      }
+      commit();
+
+      try {
+        device.poll();
+      } catch (const std::exception &ex) {
+        // Most likely the keyboard is gone, it gets reopened once it is back.
+        fmt::print(stderr, "Keyboard error: {}\n", ex.what());
+        ::poll(nullptr, 0, 100);
+      }
+      for (int fd : unresponsive)
+        disconnect(fd);
+      unresponsive.clear();
+    }
+  }
+};
+} // namespace
+
+int main(int argc, char *argv[]) try {
+  if (argc > 2) {
+    fmt::print("Usage: {} [socket path]\n", argv[0]);
+    return -1;
+  }
+  std::string path = argc == 2 ? argv[1] : socket_path();
+
+  struct sigaction action = {};
+  action.sa_handler       = [](int) { stopped = true; };
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  int listener = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listener < 0) throw std::system_error(errno, std::generic_category(), "socket");
+  auto address = socket_address(path);
+  // A stale socket from a previous run. If another daemon is still running, connect succeeds.
+  // Only a refused connection proves that nobody listens anymore, e.g. EACCES doesn't.
+  if (::access(path.c_str(), F_OK) == 0) {
+    try {
+      Client other(path);
+      fmt::print(stderr, "x50qd is already running\n");
+      return 1;
+    } catch (const std::system_error &ex) {
+      if (ex.code() != std::errc::connection_refused) throw;
+      ::unlink(path.c_str());
+    }
+  }
+  // Only the owner and its group may use the keyboard, independent of the inherited umask.
+  // Setting the mode through the umask leaves no window in which the socket is more accessible.
+  auto previous = ::umask(0117);
+  int bound     = ::bind(listener, reinterpret_cast<const sockaddr *>(&address), sizeof address);
+  ::umask(previous);
+  if (bound || ::listen(listener, 16))
+    throw std::system_error(errno, std::generic_category(), path);
+
+  Daemon daemon(listener);
+  daemon.run();
+  ::unlink(path.c_str());
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return -1;
+}
@@ -0,0 +1,61 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Runs an animation on the keyboard from a single threaded event loop, which also reacts to
+// profile changes and to stdin. Press enter to stop.
+
+#include "coro.hpp"
+#include "x50q.hpp"
+
+#include <chrono>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+using namespace mfk;
+
+coro::Task<> animate(coro::EventLoop &loop, X50Q &dev) {
+  auto status = co_await coro::status(dev);
+  fmt::print("Firmware version {:02x}, profile {}\n", status.firmware_version, status.profile);
+  std::uint8_t colors[3][144];
+  for (std::uint8_t frame = 0;; frame += 4) {
+    for (int key = 0; key != 144; ++key) {
+      colors[0][key] = frame + key;
+      colors[1][key] = 2 * key - frame;
+      colors[2][key] = frame;
+    }
+    co_await coro::apply_colors_idle(dev, colors);
+    co_await loop.sleep(std::chrono::milliseconds(30));
+  }
+}
+
+int main() {
+  X50Q dev;
+  dev.on_profile_change([](std::uint8_t profile) { fmt::print("Profile {}\n", profile); });
+  coro::EventLoop loop;
+  loop.add(dev);
+  loop.watch(STDIN_FILENO, EPOLLIN, [&](std::uint32_t) { loop.stop(); });
+  loop.spawn(animate(loop, dev));
+  loop.run();
+}
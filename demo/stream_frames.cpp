@@ -0,0 +1,218 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Pushes a stream of raw frames to the keyboard: 432 bytes each, first 144 red values, then green,
+// then blue, read from stdin or a FIFO. Only the newest frame gets sent, frames which arrive
+// while the keyboard is still busy are dropped, so the latency never builds up. Regular files are
+// played back as fast as the keyboard takes them instead. Rates are printed to stderr every second.
+//
+//   visualizer | stream_frames [--active] [FIFO]
+
+#include "coro.hpp"
+#include "x50q.hpp"
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <optional>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace mfk;
+
+class Streamer {
+  using Frame = std::array<std::byte, 3 * 144>;
+
+  X50Q &dev;
+  X50Q::Table table;
+  Frame partial;
+  std::size_t filled = 0;
+  Frame latest;
+  Frame sent;
+  bool fresh = false; // latest wasn't sent yet
+  bool busy  = false; // An upload is in flight
+  bool known = false; // sent is on the keyboard
+
+ public:
+  // uploaded only counts frames which were sent, unchanged ones didn't need any packets.
+  std::uint64_t received = 0, uploaded = 0, unchanged = 0, dropped = 0;
+
+  Streamer(X50Q &dev, X50Q::Table table): dev(dev), table(table) {}
+
+  bool idle() const { return !busy && !fresh; }
+  // A complete frame waits for the upload in flight
+  bool staged() const { return fresh; }
+
+  void feed(std::span<const std::byte> data) {
+    while (!data.empty()) {
+      auto part = data.first(std::min(data.size(), partial.size() - filled));
+      std::ranges::copy(part, partial.begin() + filled);
+      filled += part.size();
+      data = data.subspan(part.size());
+      if (filled != partial.size()) continue;
+      filled = 0;
+      ++received;
+      dropped += fresh;
+      latest = partial;
+      fresh  = true;
+    }
+  }
+
+  // Send the newest frame unless the previous one is still in flight. Only changed blocks are sent.
+  void pump() {
+    if (busy || !fresh) return;
+    fresh = false;
+    X50Q::BlockMask blocks;
+    for (std::size_t block = 0; 60 * block < latest.size(); ++block) {
+      auto size = std::min<std::size_t>(60, latest.size() - 60 * block);
+      blocks[block] =
+          !known || std::memcmp(&latest[60 * block], &sent[60 * block], size) != 0;
+    }
+    if (blocks.none()) {
+      ++unchanged;
+      return;
+    }
+    ++uploaded;
+    sent  = latest;
+    known = true;
+    busy  = true;
+    dev.apply_blocks_async(table, sent, blocks,
+                           [this](std::exception_ptr error, const X50Q::Response &) {
+                             busy = false;
+                             if (error) {
+                               // Upload everything again, the keyboard might have been reset
+                               known = false;
+                               try {
+                                 std::rethrow_exception(error);
+                               } catch (const std::exception &ex) {
+                                 fmt::print(stderr, "Upload failed: {}\n", ex.what());
+                               }
+                             }
+                             pump();
+                           });
+  }
+};
+
+coro::Task<> report(coro::EventLoop &loop, const Streamer &streamer) {
+  std::uint64_t received = 0, uploaded = 0, unchanged = 0, dropped = 0;
+  while (true) {
+    co_await loop.sleep(std::chrono::seconds(1));
+    fmt::print(stderr, "in {} fps, out {} fps, unchanged {}, dropped {}\n",
+               streamer.received - received, streamer.uploaded - uploaded,
+               streamer.unchanged - unchanged, streamer.dropped - dropped);
+    received  = streamer.received;
+    uploaded  = streamer.uploaded;
+    unchanged = streamer.unchanged;
+    dropped   = streamer.dropped;
+  }
+}
+
+// Puts the file descriptor back into its original mode on exit. stdin is shared with the shell,
+// which doesn't expect it to stay non-blocking.
+class FlagsGuard {
+  int fd, flags;
+
+ public:
+  explicit FlagsGuard(int fd): fd(fd), flags(::fcntl(fd, F_GETFL)) {}
+  FlagsGuard(const FlagsGuard &) = delete;
+  FlagsGuard &operator=(const FlagsGuard &) = delete;
+  ~FlagsGuard() { ::fcntl(fd, F_SETFL, flags); }
+
+  void set(int add) { ::fcntl(fd, F_SETFL, flags | add); }
+};
+
+int main(int argc, char *argv[]) try {
+  auto table = X50Q::Table::ColorsIdle;
+  if (argc > 1 && std::string_view(argv[1]) == "--active") {
+    table = X50Q::Table::ColorsActive;
+    --argc;
+    ++argv;
+  }
+  if (argc > 2) {
+    fmt::print("Usage: {} [--active] [FIFO]\n", argv[0]);
+    return -1;
+  }
+  int fd = argc == 2 ? ::open(argv[1], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+  if (fd < 0) throw std::system_error(errno, std::generic_category(), argv[1]);
+  struct stat info;
+  if (::fstat(fd, &info)) throw std::system_error(errno, std::generic_category(), "fstat");
+  // epoll doesn't take regular files. They never block, so instead of being watched they are
+  // read a frame at a time: the next one gets staged while the previous one is on its way, and
+  // nothing gets dropped.
+  const bool file = S_ISREG(info.st_mode);
+  FlagsGuard flags(fd);
+  if (!file) flags.set(O_NONBLOCK);
+
+  X50Q dev;
+  Streamer streamer(dev, table);
+  coro::EventLoop loop;
+  loop.add(dev);
+  bool eof = false;
+  auto read_frame = [&] {
+    std::byte buffer[3 * 144];
+    auto length = ::read(fd, buffer, sizeof buffer);
+    if (length < 0 && errno != EINTR) throw std::system_error(errno, std::generic_category());
+    if (length > 0) streamer.feed(std::span(buffer, length));
+    eof = length == 0;
+    streamer.pump();
+  };
+  if (!file) {
+    loop.watch(fd, EPOLLIN, [&](std::uint32_t) {
+      std::byte buffer[64 * 1024];
+      while (true) {
+        auto length = ::read(fd, buffer, sizeof buffer);
+        if (length > 0) {
+          streamer.feed(std::span(buffer, length));
+          continue;
+        }
+        if (length < 0 && errno == EINTR) continue;
+        if (length < 0 && errno != EAGAIN) throw std::system_error(errno, std::generic_category());
+        if (length == 0) {
+          eof = true;
+          loop.unwatch(fd);
+        }
+        break;
+      }
+      streamer.pump();
+    });
+  }
+  loop.spawn(report(loop, streamer));
+  // After the end of the input, the last frame still gets sent.
+  while (!eof || !streamer.idle()) {
+    const bool next = file && !eof && !streamer.staged();
+    if (next) read_frame();
+    loop.run_once(next ? std::optional(std::chrono::steady_clock::duration()) : std::nullopt);
+    streamer.pump();
+  }
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return -1;
+}
@@ -24,11 +24,14 @@
  */
 
 #include "hidapi.hpp"
+#include "layout.hpp"
+#include "renderer.hpp"
 #include "x50q.hpp"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <fmt/format.h>
 #include <optional>
@@ -98,45 +101,26 @@ void set_profile(X50Q &dev) {
 }
 */
 
-std::array<std::uint8_t, 115> mapping = {
-    45, 27,  18,  9,   14,  0,   5,   90, 95, 77,  63,  68,  54,  59,  99,  104, 111, 120, 129, 46,
-    37, 28,  19,  10,  15,  1,   6,   91, 96, 81,  72,  64,  60,  61,  105, 106, 102, 110, 128, 119,
-    47, 38,  29,  20,  11,  16,  2,   92, 82, 87,  73,  65,  69,  56,  101, 103, 100, 142, 115, 133,
-    48, 39,  30,  21,  25,  12,  3,   93, 83, 84,  74,  66,  58,  139, 112, 130, 124, 49,  31,  33,
-    24, 22,  13,  4,   94,  85,  86,  76, 70, 135, 136, 109, 127, 50,  41,  32,  23,  88,  79,  78,
-    67, 140, 137, 138, 141, 132, 121, 36, 42, 123, 51,  117, 126, 118, 131,
-};
-
-// UK layout support
-std::array<std::uint8_t, 117> ukMapping = {
-    45, 27,  18,  9,   14,  0,   5,   90, 95, 77,  63,  68,  54,  59,  99,  104, 111, 120, 129, 46,
-    37, 28,  19,  10,  15,  1,   6,   91, 96, 81,  72,  64,  60,  61,  105, 106, 102, 110, 128, 119,
-    47, 38,  29,  20,  11,  16,  2,   92, 82, 87,  73,  65,  69,  56,  101, 103, 100, 142, 115, 133,
-    48, 39,  30,  21,  25,  12,  3,   93, 83, 84,  74,  66,  57, 58,  139, 112, 130, 124, 49,  40, 31, 33,
-    24, 22,  13,  4,   94,  85,  86,  76, 70, 135, 136, 109, 127, 50,  41,  32,  23,  88,  79,  78,
-    67, 140, 137, 138, 141, 132, 121, 36, 42, 123, 51,  117, 126, 118, 131,
-};
-
 int main(int argc, char *argv[]) try {
   X50Q dev;
   // We start with built-in 6 (the profile activated with fn+numpad 0)
   auto status = dev.status();
   dev.set_builtin(6);
-  // Initialize a buffer for color values. At the beginning, everything is black (aka RGB 0, 0, 0)
-  std::uint8_t buf[3][144] = {};
-  // Iterate over all keys, can change to mapping for UK layout
-  for (auto i : mapping) {
-    // Set the key at index i to white by settings all three components to maximum.
+  // Show one key after another, five per second
+  Renderer renderer(dev, 5, Renderer::Target::Both);
+  std::size_t next = 0;
+  // Iterate over all keys, can change to uk_layout for UK layout
+  auto keys = us_layout.keys();
+  renderer.run([&](std::uint8_t (&buf)[3][144], const Renderer::FrameInfo &) {
+    if (next == keys.size()) return false;
+    // Start with everything black (aka RGB 0, 0, 0) such that only one key is white at a time.
+    std::memset(buf, 0, sizeof buf);
+    // Set the key to white by settings all three components to maximum.
+    auto i    = keys[next++].index;
     buf[0][i] = buf[1][i] = buf[2][i] = 0xFF;
-    // Now activate the color
-    dev.apply_colors_idle(buf);
-    // Assign the same color after pressing the key
-    dev.apply_colors_active(buf);
-    using namespace std::chrono_literals;
-    std::this_thread::sleep_for(200ms);
-    // Reset to black such that only one key is white at a time.
-    buf[0][i] = buf[1][i] = buf[2][i] = 0x0;
-  }
+    // The renderer activates the color and assigns the same color after pressing the key
+    return true;
+  });
   // Return to the previously active builtin profile (Of course, customizations get lost in the process)
   fmt::print("Resetting to {}\n", status.profile);
   dev.set_builtin(status.profile);
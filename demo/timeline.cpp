@@ -0,0 +1,127 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Records effects into timelines and plays them back, see timeline.hpp.
+//
+//   timeline record <file> <plasma|rainbow|wave|ripple> <seconds> [fps]
+//   timeline play [--stream] [--loop] <file>
+//   timeline info <file>
+
+#include "effects.hpp"
+#include "timeline.hpp"
+#include "x50q.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <string_view>
+
+using namespace mfk;
+
+int usage(const char *name) {
+  fmt::print("Usage: {0} record <file> <plasma|rainbow|wave|ripple> <seconds> [fps]\n"
+             "       {0} play [--stream] [--loop] <file>\n"
+             "       {0} info <file>\n",
+             name);
+  return -1;
+}
+
+int record(const char *path, std::string_view effect, double seconds, double fps) {
+  using namespace mfk::effects;
+  TimelineWriter writer(path);
+  // Make sure the colors are shown as they are
+  std::array<X50Q::Effect, 144> effects;
+  effects.fill(X50Q::Effect::SetColor);
+  writer.table({}, X50Q::Table::EffectsIdle, std::as_bytes(std::span(effects)));
+
+  std::uint8_t colors[3][144];
+  const int frames = int(seconds * fps);
+  for (int i = 0; i != frames; ++i) {
+    float t = i / fps;
+    if (effect == "plasma")
+      plasma(colors, us_geometry, t * 10);
+    else if (effect == "rainbow")
+      rainbow(colors, us_geometry, t / 4);
+    else if (effect == "wave")
+      wave(colors, us_geometry, {1, .3f}, 8, t, {255, 0, 64}, {0, 32, 255});
+    else if (effect == "ripple")
+      ripple(colors, us_geometry, {11, 3}, t * 8 - 2, 1.5f, {255, 255, 255}, {0, 0, 32});
+    else {
+      fmt::print(stderr, "Unknown effect {}\n", effect);
+      return 1;
+    }
+    writer.frame(std::chrono::milliseconds(std::int64_t(i * 1000 / fps)), X50Q::Table::ColorsIdle,
+                 colors);
+  }
+  writer.finish();
+  auto size = std::filesystem::file_size(path);
+  fmt::print("{} frames, {} bytes ({:.1f} per frame, raw frames take {})\n", frames, size,
+             double(size) / frames, sizeof colors);
+  return 0;
+}
+
+int main(int argc, char *argv[]) try {
+  if (argc < 3) return usage(argv[0]);
+  std::string_view command = argv[1];
+  if (command == "record") {
+    if (argc < 5 || argc > 6) return usage(argv[0]);
+    double fps = argc == 6 ? std::atof(argv[5]) : 30;
+    if (fps <= 0) return usage(argv[0]);
+    return record(argv[2], argv[3], std::atof(argv[4]), fps);
+  }
+  if (command == "info") {
+    Timeline timeline(argv[2]);
+    fmt::print("{} records, {} ms\n", timeline.records(), timeline.duration().count());
+    return 0;
+  }
+  if (command != "play") return usage(argv[0]);
+  bool map = true, loop = false;
+  int i    = 2;
+  for (; i < argc - 1; ++i) {
+    std::string_view option = argv[i];
+    if (option == "--stream")
+      map = false;
+    else if (option == "--loop")
+      loop = true;
+    else
+      return usage(argv[0]);
+  }
+  if (i != argc - 1) return usage(argv[0]);
+  Timeline timeline(argv[i], map);
+  X50Q dev;
+  do {
+    auto start  = std::chrono::steady_clock::now();
+    auto frames = play(dev, timeline);
+    auto late   = std::chrono::steady_clock::now() - start - timeline.duration();
+    fmt::print("{} of {} records uploaded, finished {} ms late\n", frames, timeline.records(),
+               std::chrono::duration_cast<std::chrono::milliseconds>(late).count());
+    timeline.rewind();
+  } while (loop);
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return -1;
+}
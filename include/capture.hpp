@@ -0,0 +1,266 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_CAPTURE_HPP
+#define X50Q_CAPTURE_HPP
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace mfk {
+/** Recordings of everything exchanged with the keyboard.
+ *
+ * Layout (little endian):
+ *
+ *   Header   "X50QCAP" magic, version
+ *   Records  A RecordHeader followed by size bytes: an output packet or an input report
+ *
+ * Timestamps come from the monotonic clock and are stored as microseconds since the previous
+ * record. Captures can be replayed with replay(), e.g. to compare the latency of the keyboard
+ * (or of the simulator) against an earlier run.
+ */
+class Capture {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  enum class Direction : std::uint8_t { Out = 1, In = 2 };
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+  };
+  struct RecordHeader {
+    std::uint32_t delta; // Microseconds since the previous record
+    Direction direction;
+    std::uint8_t size;
+    std::uint16_t reserved;
+  };
+  static_assert(sizeof(Header) == 16 && sizeof(RecordHeader) == 8);
+  static constexpr char magic[8]         = "X50QCAP";
+  static constexpr std::uint32_t version = 0x00010000;
+
+  struct Record {
+    std::chrono::microseconds time; // Since the start of the capture
+    Direction direction;
+    std::uint8_t size;
+    std::array<std::byte, 64> buffer;
+
+    std::span<const std::byte> data() const { return std::span(buffer).first(size); }
+  };
+
+  static std::vector<Record> load(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) throw std::system_error(errno, std::generic_category(), path);
+    Header header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof header) ||
+        std::memcmp(header.magic, magic, sizeof magic))
+      throw std::runtime_error("Not a capture");
+    if (header.version >> 16 != version >> 16)
+      throw std::runtime_error("Unsupported capture version");
+    std::vector<Record> records;
+    std::chrono::microseconds time{};
+    RecordHeader record;
+    while (file.read(reinterpret_cast<char *>(&record), sizeof record)) {
+      if (record.size > 64 ||
+          (record.direction != Direction::Out && record.direction != Direction::In))
+        throw std::runtime_error("Corrupt capture");
+      time += std::chrono::microseconds(record.delta);
+      auto &entry = records.emplace_back(Record{time, record.direction, record.size, {}});
+      if (!file.read(reinterpret_cast<char *>(entry.buffer.data()), record.size))
+        throw std::runtime_error("Truncated capture");
+    }
+    if (file.gcount()) throw std::runtime_error("Truncated capture");
+    return records;
+  }
+};
+
+/** Appends packets to a capture file.
+ *
+ * Can be shared between threads, e.g. when the event thread reads reports while another thread
+ * sends. Everything is written once the writer gets destroyed or flush() is called.
+ */
+class CaptureWriter {
+  std::mutex mutex;
+  std::ofstream file;
+  Capture::clock::time_point start = Capture::clock::now();
+  std::chrono::microseconds last{};
+
+ public:
+  explicit CaptureWriter(const std::string &path):
+      file(path, std::ios::binary | std::ios::trunc) {
+    if (!file) throw std::system_error(errno, std::generic_category(), path);
+    Capture::Header header{{}, Capture::version, 0};
+    std::memcpy(header.magic, Capture::magic, sizeof Capture::magic);
+    file.write(reinterpret_cast<const char *>(&header), sizeof header);
+  }
+
+  void write(Capture::Direction direction, std::span<const std::byte> data) {
+    assert(data.size() <= 64);
+    auto now = std::chrono::duration_cast<std::chrono::microseconds>(Capture::clock::now() - start);
+    std::lock_guard lock(mutex);
+    // The clock is monotonic, but two threads might have read it in a different order
+    auto delta = std::clamp<std::chrono::microseconds::rep>((now - last).count(), 0, UINT32_MAX);
+    last += std::chrono::microseconds(delta);
+    Capture::RecordHeader record{std::uint32_t(delta), direction, std::uint8_t(data.size()), 0};
+    file.write(reinterpret_cast<const char *>(&record), sizeof record);
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+  }
+
+  void flush() {
+    std::lock_guard lock(mutex);
+    if (!file.flush()) throw std::runtime_error("Unable to write capture");
+  }
+};
+
+/** Records everything passing through another transport:
+ *
+ *   auto capture = std::make_shared<CaptureWriter>("setup.cap");
+ *   X50Q dev(std::make_unique<RecordingTransport>(std::make_unique<SimulatedX50Q>(), capture));
+ *
+ * Packets are recorded when they are handed to the transport, reports when they are read.
+ * Keyboards reopened by X50Q::reconnect() get a plain transport again.
+ */
+class RecordingTransport final : public Transport {
+  std::unique_ptr<Transport> inner;
+  std::shared_ptr<CaptureWriter> capture;
+
+ public:
+  RecordingTransport(std::unique_ptr<Transport> inner, std::shared_ptr<CaptureWriter> capture):
+      inner(std::move(inner)), capture(std::move(capture)) {}
+
+  void send(std::span<const std::byte, 64> packet, std::chrono::milliseconds timeout) override {
+    capture->write(Capture::Direction::Out, packet);
+    inner->send(packet, timeout);
+  }
+  void reap() override { inner->reap(); }
+  void cancel() override { inner->cancel(); }
+  std::span<std::byte> read(std::span<std::byte> buffer,
+                            std::chrono::milliseconds timeout) override {
+    auto report = inner->read(buffer, timeout);
+    if (!report.empty()) capture->write(Capture::Direction::In, report);
+    return report;
+  }
+  int fd() const override { return inner->fd(); }
+};
+
+struct ReplayStatistics {
+  // Time from sending each packet until its acknowledgement, in the capture and in the replay
+  std::vector<std::chrono::microseconds> recorded, replayed;
+  std::chrono::microseconds recorded_duration{}, replayed_duration{};
+};
+
+/** Send the packets of a capture again.
+ *
+ * With Pacing::Original, every packet is sent at the time it was sent in the capture, with
+ * Pacing::Fast as soon as possible. Either way, a packet is only sent once as many
+ * acknowledgements arrived as before it in the capture, so the keyboard never sees more packets
+ * in flight than during the recording. Throws a TimeoutError if the keyboard stays silent for
+ * timeout while acknowledgements are missing.
+ */
+enum class Pacing { Original, Fast };
+inline ReplayStatistics replay(Transport &transport, std::span<const Capture::Record> records,
+                               Pacing pacing,
+                               std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+  using clock = Capture::clock;
+  auto is_ack = [](std::span<const std::byte> report) {
+    return report.size() >= 2 && report[0] == std::byte(8) && report[1] == std::byte(0);
+  };
+
+  ReplayStatistics stats;
+  struct Packet {
+    const Capture::Record *record;
+    std::size_t acks_before;
+  };
+  std::vector<Packet> packets;
+  std::vector<std::chrono::microseconds> recorded_sends;
+  std::size_t expected_acks = 0;
+  for (auto &record : records) {
+    if (record.direction == Capture::Direction::Out) {
+      if (record.size != 64) throw std::runtime_error("Corrupt capture");
+      packets.push_back({&record, expected_acks});
+      recorded_sends.push_back(record.time);
+    } else if (is_ack(record.data())) {
+      if (expected_acks < recorded_sends.size())
+        stats.recorded.push_back(record.time - recorded_sends[expected_acks]);
+      ++expected_acks;
+    }
+  }
+  if (!records.empty()) stats.recorded_duration = records.back().time - records.front().time;
+  expected_acks = std::min(expected_acks, packets.size());
+  const auto offset = records.empty() ? std::chrono::microseconds() : records.front().time;
+
+  std::vector<clock::time_point> send_times;
+  send_times.reserve(packets.size());
+  std::size_t acks = 0;
+  std::array<std::byte, 10> buffer;
+  const auto start   = clock::now();
+  auto last_progress = start;
+  while (send_times.size() != packets.size() || acks < expected_acks) {
+    auto now  = clock::now();
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(last_progress + timeout - now);
+    if (send_times.size() != packets.size()) {
+      auto &next = packets[send_times.size()];
+      if (acks >= next.acks_before) {
+        auto due = start + (next.record->time - offset);
+        if (pacing == Pacing::Fast || now >= due) {
+          transport.send(next.record->buffer, timeout);
+          send_times.push_back(now);
+          last_progress = now;
+          continue;
+        }
+        wait = std::chrono::ceil<std::chrono::milliseconds>(due - now);
+      }
+    }
+    transport.reap();
+    if (wait <= wait.zero()) throw TimeoutError("The keyboard stopped responding during replay");
+    auto report = transport.read(buffer, wait);
+    if (report.empty() || !is_ack(report)) continue;
+    last_progress = clock::now();
+    if (acks < send_times.size())
+      stats.replayed.push_back(
+          std::chrono::duration_cast<std::chrono::microseconds>(last_progress - send_times[acks]));
+    ++acks;
+  }
+  transport.reap();
+  stats.replayed_duration =
+      std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+  return stats;
+}
+} // namespace mfk
+#endif
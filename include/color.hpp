@@ -0,0 +1,154 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_COLOR_HPP
+#define X50Q_COLOR_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace mfk {
+/** Transfer curve from the brightness we want to the value sent to the LEDs.
+ *
+ * The LEDs are driven linearly, but brightness is perceived roughly logarithmically: a linear
+ * fade spends most of its time looking almost fully lit. The values are scaled by 256 to keep
+ * some precision for the per-key scale factors of ColorCorrection.
+ */
+struct ColorCurve {
+  std::array<std::uint16_t, 256> values = {};
+
+ private:
+  // std::pow and friends are not constexpr, so we bring our own. Only needs to be good enough
+  // for 16 bit results.
+  static constexpr double ln2 = 0.693147180559945309;
+  static constexpr double log(double x) {
+    int exponent = 0;
+    for (; x < .5; x *= 2)
+      --exponent;
+    for (; x > 1; x /= 2)
+      ++exponent;
+    // log(x) = 2 atanh((x - 1) / (x + 1)), converges quickly for x in [0.5, 1]
+    double z = (x - 1) / (x + 1), term = z, sum = 0;
+    for (int n = 1; n < 60; n += 2, term *= z * z)
+      sum += term / n;
+    return 2 * sum + exponent * ln2;
+  }
+  static constexpr double exp(double x) {
+    int exponent = int(x / ln2);
+    double r = x - exponent * ln2, term = 1, sum = 1;
+    for (int n = 1; n < 30; ++n)
+      sum += term *= r / n;
+    for (; exponent > 0; --exponent)
+      sum *= 2;
+    for (; exponent < 0; ++exponent)
+      sum /= 2;
+    return sum;
+  }
+
+  template <typename F> static consteval ColorCurve make(F &&f) {
+    ColorCurve curve;
+    for (int i = 0; i != 256; ++i)
+      curve.values[i] = std::uint16_t(std::clamp(f(i / 255.) * 255 * 256 + .5, 0., 65280.));
+    return curve;
+  }
+
+ public:
+  // value^gamma, with gamma = 1 the input is sent unchanged.
+  static consteval ColorCurve gamma(double gamma) {
+    return make([gamma](double x) { return x ? exp(gamma * log(x)) : 0; });
+  }
+  // The input is the CIE 1976 lightness L* (scaled to 0..1), the output the luminance.
+  static consteval ColorCurve lightness() {
+    return make([](double x) {
+      auto l = 100 * x;
+      return l > 8 ? (l + 16) / 116 * (l + 16) / 116 * (l + 16) / 116 : l / 903.3;
+    });
+  }
+};
+
+inline constexpr ColorCurve linear_curve    = ColorCurve::gamma(1);
+inline constexpr ColorCurve gamma22_curve   = ColorCurve::gamma(2.2);
+inline constexpr ColorCurve lightness_curve = ColorCurve::lightness();
+
+static_assert(linear_curve.values[255] == 65280 && linear_curve.values[1] == 256);
+static_assert(gamma22_curve.values[128] == 14330 && lightness_curve.values[0] == 0);
+
+/** Correction applied to color tables right before they get uploaded.
+ *
+ * Every value goes through the curve and is then scaled by a factor for its key and channel.
+ * The factors make zones which look brighter than others (e.g. the side lights or the volume
+ * ring compared to the keys) match the rest. They can only dim, factors above 1 are clamped.
+ */
+class ColorCorrection {
+  std::array<std::uint32_t, 256> curve;
+  // 256 is a factor of 1
+  alignas(32) std::uint16_t scale[3][144];
+
+ public:
+  explicit ColorCorrection(const ColorCurve &curve = lightness_curve) {
+    std::ranges::copy(curve.values, this->curve.begin());
+    std::ranges::fill(&scale[0][0], &scale[0][0] + 3 * 144, 256);
+  }
+
+  void set_scale(std::uint8_t index, float r, float g, float b) {
+    auto fixed = [](float factor) { return std::uint16_t(std::clamp(factor, 0.f, 1.f) * 256); };
+    scale[0][index] = fixed(r);
+    scale[1][index] = fixed(g);
+    scale[2][index] = fixed(b);
+  }
+  void set_scale(std::uint8_t index, float factor) { set_scale(index, factor, factor, factor); }
+
+  // Correct in into out in one pass. in and out may be the same table.
+  void apply(const std::uint8_t (&in)[3][144], std::uint8_t (&out)[3][144]) const {
+    const std::uint8_t *src = &in[0][0];
+    std::uint8_t *dst       = &out[0][0];
+    const std::uint16_t *factor = &scale[0][0];
+    std::size_t i = 0;
+#ifdef __AVX2__
+    // Eight values at a time: gather from the curve, scale, narrow to bytes.
+    const auto *table = reinterpret_cast<const int *>(curve.data());
+    for (; i != 3 * 144; i += 8) {
+      auto values =
+          _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)));
+      auto scaled = _mm256_mullo_epi32(
+          _mm256_i32gather_epi32(table, values, 4),
+          _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(factor + i))));
+      auto ints = _mm256_srli_epi32(_mm256_add_epi32(scaled, _mm256_set1_epi32(1 << 15)), 16);
+      auto words =
+          _mm_packus_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(words, words));
+    }
+#endif
+    for (; i != 3 * 144; ++i)
+      dst[i] = std::uint8_t((curve[src[i]] * factor[i] + (1 << 15)) >> 16);
+  }
+  void apply(std::uint8_t (&colors)[3][144]) const { apply(colors, colors); }
+};
+} // namespace mfk
+#endif
@@ -0,0 +1,265 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_COMPOSITOR_HPP
+#define X50Q_COMPOSITOR_HPP
+#include "shadow.hpp"
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace mfk {
+/** Blends independent layers into the tables of the keyboard.
+ *
+ * Every component (an ambient animation, status indicators, transient alerts) draws into its own
+ * layer instead of overwriting the whole buffer of the others. Layers are stacked by priority and
+ * their colors are blended per key by alpha. Effects and active durations can't be blended, so
+ * the topmost layer which sets one for a key wins. Below all layers is the background passed to
+ * the constructor.
+ *
+ * Changing a layer only marks the affected keys as dirty. present() recomputes just these keys
+ * and uploads through a ShadowState, so nothing is sent unless the result actually changed and
+ * otherwise only the changed blocks are sent.
+ */
+class Compositor {
+ public:
+  enum class Target { Idle = 0, Active = 1 };
+
+  class Layer {
+    friend class Compositor;
+
+    Compositor &owner;
+    int priority_;
+    std::uint8_t opacity_ = 255;
+    bool visible_         = true;
+    std::uint8_t colors[2][3][144] = {};
+    std::uint8_t alpha[2][144]     = {}; // 0 means the key isn't covered by this layer
+    X50Q::Effect effects[2][144]   = {};
+    std::bitset<144> has_effect[2];
+    ByteSeconds durations[144] = {};
+    std::bitset<144> has_duration;
+
+    Layer(Compositor &owner, int priority): owner(owner), priority_(priority) {}
+
+    // Everything this layer contributes to has to be recomputed
+    void touch_all() {
+      for (std::size_t t = 0; t != 2; ++t) {
+        for (std::size_t key = 0; key != 144; ++key)
+          if (alpha[t][key]) owner.dirty_colors[t].set(key);
+        owner.dirty_effects[t] |= has_effect[t];
+      }
+      owner.dirty_durations |= has_duration;
+    }
+
+   public:
+    Layer(const Layer &)            = delete;
+    Layer &operator=(const Layer &) = delete;
+
+    int priority() const { return priority_; }
+    std::uint8_t opacity() const { return opacity_; }
+    bool visible() const { return visible_; }
+
+    void set_color(Target target, std::uint8_t key, std::uint8_t r, std::uint8_t g,
+                   std::uint8_t b, std::uint8_t a = 255) {
+      assert(key < 144);
+      auto t            = std::size_t(target);
+      colors[t][0][key] = r;
+      colors[t][1][key] = g;
+      colors[t][2][key] = b;
+      alpha[t][key]     = a;
+      owner.dirty_colors[t].set(key);
+    }
+    // Let the layers below show through again
+    void clear_color(Target target, std::uint8_t key) {
+      assert(key < 144);
+      alpha[std::size_t(target)][key] = 0;
+      owner.dirty_colors[std::size_t(target)].set(key);
+    }
+    void set_effect(Target target, std::uint8_t key, X50Q::Effect effect) {
+      assert(key < 144);
+      auto t          = std::size_t(target);
+      effects[t][key] = effect;
+      has_effect[t].set(key);
+      owner.dirty_effects[t].set(key);
+    }
+    void clear_effect(Target target, std::uint8_t key) {
+      assert(key < 144);
+      has_effect[std::size_t(target)].reset(key);
+      owner.dirty_effects[std::size_t(target)].set(key);
+    }
+    void set_active_duration(std::uint8_t key, ByteSeconds duration) {
+      assert(key < 144);
+      durations[key] = duration;
+      has_duration.set(key);
+      owner.dirty_durations.set(key);
+    }
+    void clear_active_duration(std::uint8_t key) {
+      assert(key < 144);
+      has_duration.reset(key);
+      owner.dirty_durations.set(key);
+    }
+
+    // Make the whole layer transparent
+    void clear() {
+      touch_all();
+      for (auto &a : alpha) std::ranges::fill(a, 0);
+      for (auto &effect : has_effect) effect.reset();
+      has_duration.reset();
+    }
+
+    // Multiplied with the alpha of every key, e.g. to fade an alert in and out
+    void set_opacity(std::uint8_t opacity) {
+      if (opacity == opacity_) return;
+      opacity_ = opacity;
+      touch_all();
+    }
+    void set_visible(bool visible) {
+      if (visible == visible_) return;
+      visible_ = visible;
+      touch_all();
+    }
+    void set_priority(int priority) {
+      if (priority == priority_) return;
+      priority_ = priority;
+      touch_all();
+      owner.sort();
+    }
+  };
+
+ private:
+  ShadowState state;
+  ShadowState::Tables background;
+  std::vector<std::unique_ptr<Layer>> layers; // Bottom to top
+  std::bitset<144> dirty_colors[2];
+  std::bitset<144> dirty_effects[2];
+  std::bitset<144> dirty_durations;
+  bool pending = true; // The ShadowState has changes which weren't committed yet
+
+  void sort() {
+    std::ranges::stable_sort(layers, {}, [](const auto &layer) { return layer->priority_; });
+  }
+
+  static std::uint8_t blend(std::uint8_t top, std::uint8_t bottom, unsigned alpha) {
+    return std::uint8_t((top * alpha + bottom * (255 - alpha) + 127) / 255);
+  }
+
+  // Recompute the dirty keys. Returns whether any of them changed.
+  bool compose() {
+    auto &tables = state.tables();
+    bool changed = false;
+    auto update  = [&changed](auto &value, auto result) {
+      changed |= value != result;
+      value = result;
+    };
+    for (std::size_t t = 0; t != 2; ++t) {
+      auto &colors = t ? tables.colors_active : tables.colors_idle;
+      auto &base   = t ? background.colors_active : background.colors_idle;
+      for (std::size_t key = 0; dirty_colors[t].any() && key != 144; ++key) {
+        if (!dirty_colors[t][key]) continue;
+        std::uint8_t result[3] = {base[0][key], base[1][key], base[2][key]};
+        for (auto &layer : layers) {
+          if (!layer->visible_ || !layer->alpha[t][key]) continue;
+          auto alpha = (layer->alpha[t][key] * layer->opacity_ + 127) / 255;
+          for (std::size_t c = 0; c != 3; ++c)
+            result[c] = blend(layer->colors[t][c][key], result[c], alpha);
+        }
+        for (std::size_t c = 0; c != 3; ++c) update(colors[c][key], result[c]);
+      }
+      dirty_colors[t].reset();
+
+      auto &effects      = t ? tables.effects_active : tables.effects_idle;
+      auto &base_effects = t ? background.effects_active : background.effects_idle;
+      for (std::size_t key = 0; dirty_effects[t].any() && key != 144; ++key) {
+        if (!dirty_effects[t][key]) continue;
+        auto top = std::find_if(layers.rbegin(), layers.rend(), [&](const auto &layer) {
+          return layer->visible_ && layer->opacity_ && layer->has_effect[t][key];
+        });
+        update(effects[key], top == layers.rend() ? base_effects[key] : (*top)->effects[t][key]);
+      }
+      dirty_effects[t].reset();
+    }
+    for (std::size_t key = 0; dirty_durations.any() && key != 144; ++key) {
+      if (!dirty_durations[key]) continue;
+      auto top = std::find_if(layers.rbegin(), layers.rend(), [&](const auto &layer) {
+        return layer->visible_ && layer->opacity_ && layer->has_duration[key];
+      });
+      update(tables.active_duration[key],
+             top == layers.rend() ? background.active_duration[key] : (*top)->durations[key]);
+    }
+    dirty_durations.reset();
+    return changed;
+  }
+
+ public:
+  explicit Compositor(X50Q &device, const ShadowState::Tables &background = {}):
+      state(device), background(background) {
+    state.tables() = background;
+  }
+
+  /** Add a layer above all layers with the same or a lower priority.
+   *
+   * The layer stays valid until it is passed to remove_layer() or the compositor is destroyed.
+   */
+  Layer &add_layer(int priority = 0) {
+    auto layer = std::unique_ptr<Layer>(new Layer(*this, priority));
+    auto pos   = std::ranges::upper_bound(layers, priority, {},
+                                          [](const auto &layer) { return layer->priority_; });
+    return **layers.insert(pos, std::move(layer));
+  }
+
+  void remove_layer(Layer &layer) {
+    layer.touch_all();
+    std::erase_if(layers, [&](const auto &entry) { return entry.get() == &layer; });
+  }
+
+  /** Recompute the keys changed since the last call and upload the result.
+   *
+   * Returns whether anything had to be uploaded. Upload errors are rethrown and the next
+   * present() tries again.
+   */
+  bool present() {
+    pending |= compose();
+    if (!pending) return false;
+    state.commit();
+    pending = false;
+    return true;
+  }
+
+  // The keyboard might have changed behind our back, the next present() uploads everything.
+  void invalidate() {
+    state.invalidate();
+    pending = true;
+  }
+
+  // E.g. for restore_on_reconnect()
+  ShadowState &shadow() { return state; }
+};
+} // namespace mfk
+#endif
@@ -0,0 +1,482 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_CORO_HPP
+#define X50Q_CORO_HPP
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <optional>
+#include <poll.h>
+#include <queue>
+#include <span>
+#include <sys/epoll.h>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/** Coroutines driven by an epoll event loop.
+ *
+ * Every command of X50Q can be awaited without blocking the thread:
+ *
+ *   mfk::coro::Task<> fade(mfk::coro::EventLoop &loop, mfk::X50Q &dev) {
+ *     auto status = co_await mfk::coro::status(dev);
+ *     co_await mfk::coro::apply_colors_idle(dev, colors);
+ *     co_await loop.sleep(std::chrono::milliseconds(20));
+ *   }
+ *   mfk::coro::EventLoop loop;
+ *   loop.add(dev);
+ *   loop.spawn(fade(loop, dev));
+ *   loop.run();
+ *
+ * The loop waits on the hidraw node (see Transport::fd) and the file descriptors of libusb, so
+ * a single thread can serve any number of keyboards together with other file descriptors. Don't
+ * start the event thread of keyboards added to a loop.
+ */
+namespace mfk::coro {
+template <typename T = void> class Task;
+
+namespace detail {
+// Continues with the awaiting coroutine once a Task finished.
+struct ResumeContinuation {
+  bool await_ready() noexcept { return false; }
+  template <typename Promise>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept {
+    return done.promise().continuation;
+  }
+  void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr error;
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  ResumeContinuation final_suspend() noexcept { return {}; }
+  void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T> struct Promise : PromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  template <typename U> void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+  T result() {
+    if (error) std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+template <> struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() {
+    if (error) std::rethrow_exception(error);
+  }
+};
+} // namespace detail
+
+/** A coroutine which starts once it gets awaited (or spawned on an EventLoop).
+ *
+ * Its result, or its exception, is passed to the awaiting coroutine.
+ */
+template <typename T> class [[nodiscard]] Task {
+ public:
+  using promise_type = detail::Promise<T>;
+
+ private:
+  std::coroutine_handle<promise_type> handle;
+
+  friend promise_type;
+  friend class EventLoop;
+  explicit Task(std::coroutine_handle<promise_type> handle): handle(handle) {}
+
+ public:
+  Task(Task &&other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+  Task &operator=(Task &&other) noexcept {
+    std::swap(handle, other.handle);
+    return *this;
+  }
+  ~Task() {
+    if (handle) handle.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+  T await_resume() { return handle.promise().result(); }
+};
+
+template <typename T> Task<T> detail::Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise>::from_promise(*this));
+}
+inline Task<void> detail::Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise>::from_promise(*this));
+}
+
+/** Awaits one of the *_async functions of X50Q.
+ *
+ * start gets called with the completion callback. The awaiting coroutine is resumed from the
+ * callback, i.e. from inside X50Q::poll.
+ */
+template <typename T, typename Start> class [[nodiscard]] Operation {
+  Start start;
+  std::coroutine_handle<> waiting;
+  std::exception_ptr error;
+  std::optional<T> value;
+  bool started  = false;
+  bool finished = false;
+
+ public:
+  explicit Operation(Start start): start(std::move(start)) {}
+
+  bool await_ready() const noexcept { return false; }
+  // Commands which fail right away complete before start returns, these don't suspend at all.
+  bool await_suspend(std::coroutine_handle<> awaiting) {
+    waiting = awaiting;
+    start([this](std::exception_ptr e, const auto &result) {
+      error = std::move(e);
+      if (!error) value.emplace(result);
+      finished = true;
+      if (started) waiting.resume();
+    });
+    started = true;
+    return !finished;
+  }
+  T await_resume() {
+    if (error) std::rethrow_exception(error);
+    return std::move(*value);
+  }
+};
+
+template <typename T, typename Start> auto make_operation(Start start) {
+  // Acknowledgements of commands without a result get stored, but never returned.
+  using Stored = std::conditional_t<std::is_void_v<T>, X50Q::Response, T>;
+  struct Awaitable : Operation<Stored, Start> {
+    using Operation<Stored, Start>::Operation;
+    T await_resume() {
+      if constexpr (std::is_void_v<T>)
+        Operation<Stored, Start>::await_resume();
+      else
+        return Operation<Stored, Start>::await_resume();
+    }
+  };
+  return Awaitable(std::move(start));
+}
+
+// The data is copied before the awaiting coroutine suspends, so it doesn't have to stay alive.
+inline auto status(X50Q &dev) {
+  return make_operation<X50Q::Status>([&dev](auto done) { dev.status_async(std::move(done)); });
+}
+inline auto set_builtin(X50Q &dev, std::uint8_t index) {
+  return make_operation<void>(
+      [&dev, index](auto done) { dev.set_builtin_async(index, std::move(done)); });
+}
+inline auto apply_colors_idle(X50Q &dev, std::span<const std::uint8_t[144]> data) {
+  return make_operation<void>(
+      [&dev, data](auto done) { dev.apply_colors_idle_async(data, std::move(done)); });
+}
+inline auto apply_colors_active(X50Q &dev, std::span<const std::uint8_t[144]> data) {
+  return make_operation<void>(
+      [&dev, data](auto done) { dev.apply_colors_active_async(data, std::move(done)); });
+}
+inline auto apply_effects_idle(X50Q &dev, std::span<const X50Q::Effect> data) {
+  return make_operation<void>(
+      [&dev, data](auto done) { dev.apply_effects_idle_async(data, std::move(done)); });
+}
+inline auto apply_effects_active(X50Q &dev, std::span<const X50Q::Effect> data) {
+  return make_operation<void>(
+      [&dev, data](auto done) { dev.apply_effects_active_async(data, std::move(done)); });
+}
+inline auto apply_active_duration(X50Q &dev, std::span<const ByteSeconds> data) {
+  return make_operation<void>(
+      [&dev, data](auto done) { dev.apply_active_duration_async(data, std::move(done)); });
+}
+inline auto apply_blocks(X50Q &dev, X50Q::Table table, std::span<const std::byte> data,
+                         X50Q::BlockMask blocks = X50Q::BlockMask().set()) {
+  return make_operation<void>([&dev, table, data, blocks](auto done) {
+    dev.apply_blocks_async(table, data, blocks, std::move(done));
+  });
+}
+
+/** A single threaded event loop based on epoll.
+ *
+ * Keyboards get polled whenever their hidraw node or libusb has something for them. Transports
+ * without a file descriptor (e.g. hidapi on other platforms) are polled every millisecond while
+ * commands are queued and every 10ms otherwise. Errors of keyboards without queued commands are
+ * dropped, the keyboard gets reopened before the next command anyway.
+ */
+class EventLoop {
+  using clock = std::chrono::steady_clock;
+
+  struct Keyboard {
+    X50Q *device;
+    int fd      = -1;
+    int dropped = -1; // Reported an error, so it isn't watched until the transport changes
+    bool usb    = false;
+  };
+  struct Timer {
+    clock::time_point due;
+    std::coroutine_handle<> waiting;
+    bool operator>(const Timer &other) const { return due > other.due; }
+  };
+
+  int epoll;
+  bool stopped = false;
+  std::unordered_map<int, std::function<void(std::uint32_t)>> watches;
+  // Callbacks removed while they might be running, destroyed after the current iteration
+  std::vector<std::function<void(std::uint32_t)>> retired;
+  std::vector<std::unique_ptr<Keyboard>> keyboards;
+  bool usb_watched = false;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+  clock::time_point next_tick = clock::time_point::max();
+  std::list<Task<>> spawned;
+  std::exception_ptr error;
+
+  static bool readable(int fd) {
+    pollfd ready{fd, POLLIN, 0};
+    return ::poll(&ready, 1, 0) == 1 && (ready.revents & POLLIN);
+  }
+
+  // Poll the keyboard until it has nothing left to read.
+  void drive(Keyboard &keyboard, std::uint32_t events = 0) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+      unwatch(keyboard.fd);
+      keyboard.dropped = std::exchange(keyboard.fd, -1);
+    }
+    try {
+      do
+        keyboard.device->poll();
+      while (keyboard.device && keyboard.fd >= 0 && readable(keyboard.fd));
+    } catch (...) {}
+    if (keyboard.device) sync(keyboard);
+  }
+
+  // Watch the file descriptor of the current transport, which changes on reconnect.
+  void sync(Keyboard &keyboard) {
+    const int fd = keyboard.device->transport().fd();
+    if (fd == keyboard.fd || fd == keyboard.dropped) return;
+    if (keyboard.fd >= 0) unwatch(keyboard.fd);
+    keyboard.fd      = fd;
+    keyboard.dropped = -1;
+    if (fd >= 0)
+      watch(fd, EPOLLIN, [this, &keyboard](std::uint32_t events) {
+        if (keyboard.device) drive(keyboard, events);
+      });
+  }
+
+  void drive_usb() {
+    try {
+      libusb::Context::get().handle_events();
+    } catch (...) {}
+    for (auto &keyboard : keyboards)
+      if (keyboard->device && keyboard->usb) drive(*keyboard);
+  }
+
+  static std::uint32_t epoll_events(short events) {
+    return (events & POLLIN ? std::uint32_t(EPOLLIN) : 0) |
+           (events & POLLOUT ? std::uint32_t(EPOLLOUT) : 0);
+  }
+
+  void watch_usb() {
+    auto &context = libusb::Context::get();
+    for (auto &pollfd : context.pollfds())
+      watch(pollfd.fd, epoll_events(pollfd.events), [this](std::uint32_t) { drive_usb(); });
+    // Called from inside libusb, so exceptions are kept until run_once() can rethrow them.
+    context.on_pollfds_changed(
+        [](int fd, short events, void *user_data) {
+          auto loop = static_cast<EventLoop *>(user_data);
+          try {
+            loop->watch(fd, epoll_events(events), [loop](std::uint32_t) { loop->drive_usb(); });
+          } catch (...) {
+            if (!loop->error) loop->error = std::current_exception();
+          }
+        },
+        [](int fd, void *user_data) {
+          auto loop = static_cast<EventLoop *>(user_data);
+          try {
+            loop->unwatch(fd);
+          } catch (...) {
+            if (!loop->error) loop->error = std::current_exception();
+          }
+        },
+        this);
+    usb_watched = true;
+  }
+
+  Task<> supervise(Task<> task) {
+    try {
+      co_await task;
+    } catch (...) {
+      if (!error) error = std::current_exception();
+    }
+  }
+
+ public:
+  EventLoop(): epoll(::epoll_create1(EPOLL_CLOEXEC)) {
+    if (epoll < 0) throw std::system_error(errno, std::generic_category(), "epoll_create1");
+  }
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+  // Spawned tasks which didn't finish yet are destroyed.
+  ~EventLoop() {
+    if (usb_watched) libusb::Context::get().on_pollfds_changed(nullptr, nullptr, nullptr);
+    spawned.clear();
+    ::close(epoll);
+  }
+
+  /** Call callback with the ready events (EPOLLIN etc.) whenever fd is ready.
+   *
+   * Only one callback per file descriptor. Unwatch it before closing it.
+   */
+  void watch(int fd, std::uint32_t events, std::function<void(std::uint32_t)> callback) {
+    epoll_event event{events, {.fd = fd}};
+    if (::epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event))
+      throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+    watches[fd] = std::move(callback);
+  }
+  void unwatch(int fd) {
+    // Fails if fd already got closed, which removed it from the epoll set as well.
+    ::epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+    if (auto watch = watches.find(fd); watch != watches.end()) {
+      retired.push_back(std::move(watch->second));
+      watches.erase(watch);
+    }
+  }
+
+  // Drive the commands of dev from this loop. dev has to stay alive until it gets removed.
+  void add(X50Q &dev) {
+    auto &keyboard = *keyboards.emplace_back(std::make_unique<Keyboard>(&dev));
+    keyboard.usb   = dynamic_cast<UsbTransport *>(&dev.transport());
+    if (keyboard.usb && !usb_watched) watch_usb();
+    sync(keyboard);
+  }
+  void remove(X50Q &dev) {
+    for (auto &keyboard : keyboards) {
+      if (keyboard->device != &dev) continue;
+      if (keyboard->fd >= 0) unwatch(keyboard->fd);
+      // Only marked, a coroutine resumed from drive() might remove its own keyboard.
+      keyboard->device = nullptr;
+      keyboard->fd     = -1;
+    }
+  }
+
+  // Start a coroutine. Its exceptions are rethrown from run().
+  void spawn(Task<> task) {
+    spawned.push_back(supervise(std::move(task)));
+    spawned.back().handle.resume();
+  }
+
+  // Resume the awaiting coroutine from this loop after duration.
+  auto sleep(clock::duration duration) {
+    struct Sleep {
+      EventLoop &loop;
+      clock::time_point due;
+      bool await_ready() const noexcept { return due <= clock::now(); }
+      void await_suspend(std::coroutine_handle<> waiting) { loop.timers.push({due, waiting}); }
+      void await_resume() const noexcept {}
+    };
+    return Sleep{*this, clock::now() + duration};
+  }
+
+  // Make run() return after the current iteration.
+  void stop() { stopped = true; }
+
+  // Run until stop() gets called or a spawned task fails.
+  void run() {
+    stopped = false;
+    while (!stopped)
+      run_once();
+  }
+
+  // Wait for the next event (or at most timeout) and dispatch everything which is ready.
+  void run_once(std::optional<clock::duration> timeout = std::nullopt) {
+    auto now  = clock::now();
+    auto wait = timeout ? std::optional(now + *timeout) : std::nullopt;
+    if (!timers.empty()) wait = std::min(wait.value_or(timers.top().due), timers.top().due);
+    bool tick = false;
+    for (auto &keyboard : keyboards) {
+      if (!keyboard->device) continue;
+      // Deadlines of queued commands have to be checked even if nothing arrives. They are taken
+      // from the device, so commands submitted since the last poll() are covered as well.
+      auto deadline = keyboard->device->next_deadline();
+      if (keyboard->fd < 0)
+        deadline = std::min(deadline.value_or(clock::time_point::max()),
+                            now + std::chrono::milliseconds(deadline ? 1 : 10));
+      if (!deadline) continue;
+      tick      = true;
+      next_tick = std::min(next_tick, *deadline);
+      wait      = std::min(wait.value_or(next_tick), next_tick);
+    }
+    int milliseconds = -1;
+    if (wait)
+      milliseconds = int(std::max<std::int64_t>(
+          0, std::chrono::ceil<std::chrono::milliseconds>(*wait - now).count()));
+
+    epoll_event events[16];
+    int count = ::epoll_wait(epoll, events, std::size(events), milliseconds);
+    if (count < 0 && errno != EINTR)
+      throw std::system_error(errno, std::generic_category(), "epoll_wait");
+    for (int i = 0; i < count; ++i)
+      if (auto watch = watches.find(events[i].data.fd); watch != watches.end())
+        watch->second(events[i].events);
+
+    now = clock::now();
+    while (!timers.empty() && timers.top().due <= now) {
+      auto waiting = timers.top().waiting;
+      timers.pop();
+      waiting.resume();
+    }
+    if (tick && next_tick <= now) {
+      next_tick = clock::time_point::max();
+      for (std::size_t i = 0; i != keyboards.size(); ++i)
+        if (keyboards[i]->device &&
+            (keyboards[i]->fd < 0 || keyboards[i]->device->next_deadline()))
+          drive(*keyboards[i]);
+    }
+
+    std::erase_if(keyboards, [](auto &keyboard) { return !keyboard->device; });
+    std::erase_if(spawned, [](auto &task) { return task.handle.done(); });
+    retired.clear();
+    if (error) {
+      stopped = true;
+      std::rethrow_exception(std::exchange(error, nullptr));
+    }
+  }
+};
+} // namespace mfk::coro
+#endif
@@ -0,0 +1,285 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_EFFECTS_HPP
+#define X50Q_EFFECTS_HPP
+#include "layout.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/** Vector types used by the effect kernels.
+ *
+ * All of them provide the arithmetic operators, min, max, abs, sqrt and floor, load 'width'
+ * floats and store 'width' bytes, clamped to 0..255. The kernels are written once against this
+ * interface. Which backends exist depends on the target flags (e.g. -mavx2 or -march=native),
+ * Native is the widest one available.
+ */
+namespace mfk::simd {
+struct Scalar {
+  static constexpr std::size_t width     = 1;
+  static constexpr std::string_view name = "scalar";
+  float v;
+
+  Scalar(float v = 0): v(v) {}
+  static Scalar load(const float *ptr) { return *ptr; }
+  void store(std::uint8_t *ptr) const { *ptr = std::uint8_t(std::clamp(v, 0.f, 255.f) + .5f); }
+
+  friend Scalar operator+(Scalar a, Scalar b) { return a.v + b.v; }
+  friend Scalar operator-(Scalar a, Scalar b) { return a.v - b.v; }
+  friend Scalar operator*(Scalar a, Scalar b) { return a.v * b.v; }
+  friend Scalar min(Scalar a, Scalar b) { return std::min(a.v, b.v); }
+  friend Scalar max(Scalar a, Scalar b) { return std::max(a.v, b.v); }
+  friend Scalar abs(Scalar a) { return std::fabs(a.v); }
+  friend Scalar sqrt(Scalar a) { return std::sqrt(a.v); }
+  friend Scalar floor(Scalar a) { return std::floor(a.v); }
+};
+
+#ifdef __SSE2__
+struct Sse2 {
+  static constexpr std::size_t width     = 4;
+  static constexpr std::string_view name = "sse2";
+  __m128 v;
+
+  Sse2(float v = 0): v(_mm_set1_ps(v)) {}
+  Sse2(__m128 v): v(v) {}
+  static Sse2 load(const float *ptr) { return _mm_loadu_ps(ptr); }
+  void store(std::uint8_t *ptr) const {
+    auto clamped = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255));
+    auto ints    = _mm_cvtps_epi32(clamped);
+    auto bytes   = _mm_packus_epi16(_mm_packs_epi32(ints, ints), ints);
+    auto packed  = _mm_cvtsi128_si32(bytes);
+    std::memcpy(ptr, &packed, width);
+  }
+
+  friend Sse2 operator+(Sse2 a, Sse2 b) { return _mm_add_ps(a.v, b.v); }
+  friend Sse2 operator-(Sse2 a, Sse2 b) { return _mm_sub_ps(a.v, b.v); }
+  friend Sse2 operator*(Sse2 a, Sse2 b) { return _mm_mul_ps(a.v, b.v); }
+  friend Sse2 min(Sse2 a, Sse2 b) { return _mm_min_ps(a.v, b.v); }
+  friend Sse2 max(Sse2 a, Sse2 b) { return _mm_max_ps(a.v, b.v); }
+  friend Sse2 abs(Sse2 a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+  friend Sse2 sqrt(Sse2 a) { return _mm_sqrt_ps(a.v); }
+  // SSE2 has no rounding instructions: Truncate and correct negative values.
+  friend Sse2 floor(Sse2 a) {
+    auto truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, a.v), _mm_set1_ps(1)));
+  }
+};
+#endif
+
+#ifdef __AVX2__
+struct Avx2 {
+  static constexpr std::size_t width     = 8;
+  static constexpr std::string_view name = "avx2";
+  __m256 v;
+
+  Avx2(float v = 0): v(_mm256_set1_ps(v)) {}
+  Avx2(__m256 v): v(v) {}
+  static Avx2 load(const float *ptr) { return _mm256_loadu_ps(ptr); }
+  void store(std::uint8_t *ptr) const {
+    auto clamped = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255));
+    auto ints    = _mm256_cvtps_epi32(clamped);
+    auto words =
+        _mm_packs_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(ptr), _mm_packus_epi16(words, words));
+  }
+
+  friend Avx2 operator+(Avx2 a, Avx2 b) { return _mm256_add_ps(a.v, b.v); }
+  friend Avx2 operator-(Avx2 a, Avx2 b) { return _mm256_sub_ps(a.v, b.v); }
+  friend Avx2 operator*(Avx2 a, Avx2 b) { return _mm256_mul_ps(a.v, b.v); }
+  friend Avx2 min(Avx2 a, Avx2 b) { return _mm256_min_ps(a.v, b.v); }
+  friend Avx2 max(Avx2 a, Avx2 b) { return _mm256_max_ps(a.v, b.v); }
+  friend Avx2 abs(Avx2 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+  friend Avx2 sqrt(Avx2 a) { return _mm256_sqrt_ps(a.v); }
+  friend Avx2 floor(Avx2 a) { return _mm256_floor_ps(a.v); }
+};
+#endif
+
+#if defined(__AVX2__)
+using Native = Avx2;
+#elif defined(__SSE2__)
+using Native = Sse2;
+#else
+using Native = Scalar;
+#endif
+} // namespace mfk::simd
+
+/** Effects computed on the host, written straight into the planar color tables.
+ *
+ * Every kernel evaluates a function of the physical key position for all 144 slots, one vector
+ * at a time. Positions are in key widths (see Key), times and phases in turns of the period.
+ * Slots without an LED sit at the origin, whatever gets written there is ignored.
+ */
+namespace mfk::effects {
+struct Point {
+  float x, y;
+};
+struct Rgb {
+  std::uint8_t r, g, b;
+};
+
+// The positions of all slots in planar form, like the color tables.
+struct Geometry {
+  alignas(32) float x[144] = {};
+  alignas(32) float y[144] = {};
+
+  template <std::size_t N>
+  constexpr explicit Geometry(const Layout<N> &layout) {
+    for (auto &key : layout.keys()) {
+      x[key.index] = key.x;
+      y[key.index] = key.y;
+    }
+  }
+};
+inline constexpr Geometry us_geometry(us_layout);
+inline constexpr Geometry uk_geometry(uk_layout);
+
+// Components in 0..255
+template <class V>
+struct Color {
+  V r, g, b;
+};
+
+template <class V>
+V clamp01(V value) {
+  return min(max(value, 0.f), 1.f);
+}
+
+// sin(2 pi turns), the error is about 0.001
+template <class V>
+V sin_turns(V turns) {
+  auto t = turns - floor(turns + .5f);
+  auto y = 8.f * t - 16.f * t * abs(t);
+  return y + .225f * (y * abs(y) - y);
+}
+
+// Linear interpolation, t between 0 (a) and 1 (b)
+template <class V>
+Color<V> mix(Rgb a, Rgb b, V t) {
+  return {float(a.r) + float(b.r - a.r) * t, float(a.g) + float(b.g - a.g) * t,
+          float(a.b) + float(b.b - a.b) * t};
+}
+
+// A fully saturated color. The hue is in turns: 0 is red, 1/3 green and 2/3 blue.
+template <class V>
+Color<V> hue(V turns, float value = 255) {
+  auto h = (turns - floor(turns)) * 6.f;
+  return {clamp01(abs(h - 3.f) - 1.f) * value, clamp01(2.f - abs(h - 2.f)) * value,
+          clamp01(2.f - abs(h - 4.f)) * value};
+}
+
+// Evaluate shader(x, y) -> Color<V> for all slots.
+template <class V = simd::Native, class Shader>
+void render(std::uint8_t (&colors)[3][144], const Geometry &geometry, Shader &&shader) {
+  static_assert(144 % V::width == 0);
+  for (std::size_t i = 0; i != 144; i += V::width) {
+    Color<V> color = shader(V::load(geometry.x + i), V::load(geometry.y + i));
+    color.r.store(colors[0] + i);
+    color.g.store(colors[1] + i);
+    color.b.store(colors[2] + i);
+  }
+}
+
+// From a at from to b at to. Keys beyond the ends get the color of the closer end.
+template <class V = simd::Native>
+void linear_gradient(std::uint8_t (&colors)[3][144], const Geometry &geometry, Point from,
+                     Point to, Rgb a, Rgb b) {
+  const float dx = to.x - from.x, dy = to.y - from.y;
+  const float scale = 1 / (dx * dx + dy * dy);
+  render<V>(colors, geometry, [&](V x, V y) {
+    return mix(a, b, clamp01(((x - from.x) * dx + (y - from.y) * dy) * scale));
+  });
+}
+
+// From inner at center to outer at radius and beyond.
+template <class V = simd::Native>
+void radial_gradient(std::uint8_t (&colors)[3][144], const Geometry &geometry, Point center,
+                     float radius, Rgb inner, Rgb outer) {
+  render<V>(colors, geometry, [&](V x, V y) {
+    auto dx = x - center.x, dy = y - center.y;
+    return mix(inner, outer, clamp01(sqrt(dx * dx + dy * dy) * (1 / radius)));
+  });
+}
+
+/** A sine wave between a and b moving along direction.
+ *
+ * Advance phase by the frame time divided by the period to make it travel, one turn moves it
+ * by one wavelength.
+ */
+template <class V = simd::Native>
+void wave(std::uint8_t (&colors)[3][144], const Geometry &geometry, Point direction,
+          float wavelength, float phase, Rgb a, Rgb b) {
+  const float scale = 1 / (wavelength * std::hypot(direction.x, direction.y));
+  const float kx = direction.x * scale, ky = direction.y * scale;
+  render<V>(colors, geometry, [&](V x, V y) {
+    return mix(a, b, .5f + .5f * sin_turns(x * kx + y * ky - phase));
+  });
+}
+
+// Classic plasma: The sum of four sine waves of the position mapped to a hue. time in seconds.
+template <class V = simd::Native>
+void plasma(std::uint8_t (&colors)[3][144], const Geometry &geometry, float time,
+            float scale = .1f, float value = 255) {
+  render<V>(colors, geometry, [&](V x, V y) {
+    auto dx = x - 11.f, dy = y - 3.5f;
+    auto sum = sin_turns(x * scale + time * .1f) + sin_turns(y * (scale * 1.7f) - time * .13f) +
+               sin_turns((x + y) * (scale * .6f) + time * .07f) +
+               sin_turns(sqrt(dx * dx + dy * dy) * scale - time * .05f);
+    return hue(sum * .25f + time * .02f, value);
+  });
+}
+
+// A ring of the given radius and width around center. Grow the radius to let it spread.
+template <class V = simd::Native>
+void ripple(std::uint8_t (&colors)[3][144], const Geometry &geometry, Point center,
+            float radius, float width, Rgb color, Rgb background) {
+  render<V>(colors, geometry, [&](V x, V y) {
+    auto dx = x - center.x, dy = y - center.y;
+    auto distance = sqrt(dx * dx + dy * dy);
+    return mix(background, color, clamp01(1.f - abs(distance - radius) * (1 / width)));
+  });
+}
+
+/** Rainbow, like Effect::Cycle but computed on the host.
+ *
+ * offset is the hue at the origin in turns, spread the change of the hue per key width. With
+ * spread {0, 0} all keys have the same color, exactly like Effect::Cycle.
+ */
+template <class V = simd::Native>
+void rainbow(std::uint8_t (&colors)[3][144], const Geometry &geometry, float offset,
+             Point spread = {1 / 23.f, 0}, float value = 255) {
+  render<V>(colors, geometry, [&](V x, V y) {
+    return hue(x * spread.x + y * spread.y + offset, value);
+  });
+}
+} // namespace mfk::effects
+#endif
@@ -25,6 +25,7 @@
 
 #ifndef HIDAPI_HPP
 #define HIDAPI_HPP
+#include <chrono>
 #include <codecvt>
 #include <fmt/format.h>
 #include <hidapi.h>
@@ -124,6 +125,13 @@ class HidDevice {
     if (read == -1) throw HidError(native_handle());
     return buffer.subspan(0, read);
   }
+  // Like read, but gives up after timeout. A timeout of zero never blocks.
+  std::span<std::byte> read(std::span<std::byte> buffer, std::chrono::milliseconds timeout) {
+    auto read = hid_read_timeout(native_handle(), reinterpret_cast<unsigned char *>(buffer.data()),
+                                 buffer.size(), timeout.count());
+    if (read == -1) throw HidError(native_handle());
+    return buffer.subspan(0, read);
+  }
 };
 
 class HidApi {
@@ -0,0 +1,97 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_INPLACE_FUNCTION_HPP
+#define X50Q_INPLACE_FUNCTION_HPP
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace mfk {
+/** Like std::function, but the callable is always stored inline, so it never allocates.
+ *
+ * Callables larger than Capacity are rejected at compile time. Move only.
+ */
+template <typename Signature, std::size_t Capacity = 64> class InplaceFunction;
+
+template <typename R, typename... Args, std::size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+  struct VTable {
+    R (*call)(void *, Args &&...);
+    void (*move)(void *to, void *from) noexcept; // Also destroys from
+    void (*destroy)(void *) noexcept;
+  };
+  template <typename F>
+  static constexpr VTable vtable_for = {
+      [](void *f, Args &&...args) -> R {
+        return std::invoke(*static_cast<F *>(f), std::forward<Args>(args)...);
+      },
+      [](void *to, void *from) noexcept {
+        ::new (to) F(std::move(*static_cast<F *>(from)));
+        static_cast<F *>(from)->~F();
+      },
+      [](void *f) noexcept { static_cast<F *>(f)->~F(); }};
+
+  alignas(std::max_align_t) mutable std::byte storage[Capacity];
+  const VTable *vtable = nullptr;
+
+  void reset() noexcept {
+    if (vtable) vtable->destroy(storage);
+    vtable = nullptr;
+  }
+
+ public:
+  InplaceFunction() noexcept = default;
+  InplaceFunction(std::nullptr_t) noexcept {}
+  template <typename F>
+    requires(!std::is_same_v<std::remove_cvref_t<F>, InplaceFunction> &&
+             std::is_invocable_r_v<R, std::decay_t<F> &, Args...>)
+  InplaceFunction(F &&f) {
+    using Stored = std::decay_t<F>;
+    static_assert(sizeof(Stored) <= Capacity, "The callable is too large for InplaceFunction");
+    static_assert(alignof(Stored) <= alignof(std::max_align_t));
+    static_assert(std::is_nothrow_move_constructible_v<Stored>);
+    ::new (storage) Stored(std::forward<F>(f));
+    vtable = &vtable_for<Stored>;
+  }
+  InplaceFunction(InplaceFunction &&other) noexcept: vtable(std::exchange(other.vtable, nullptr)) {
+    if (vtable) vtable->move(storage, other.storage);
+  }
+  InplaceFunction &operator=(InplaceFunction &&other) noexcept {
+    if (this == &other) return *this;
+    reset();
+    vtable = std::exchange(other.vtable, nullptr);
+    if (vtable) vtable->move(storage, other.storage);
+    return *this;
+  }
+  ~InplaceFunction() { reset(); }
+
+  explicit operator bool() const noexcept { return vtable; }
+  R operator()(Args... args) const { return vtable->call(storage, std::forward<Args>(args)...); }
+};
+} // namespace mfk
+#endif
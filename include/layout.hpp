@@ -0,0 +1,298 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_LAYOUT_HPP
+#define X50Q_LAYOUT_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+namespace mfk {
+/** A single LED of the keyboard.
+ *
+ * Most of them are keys, the last row contains the LEDs of the side bars and the volume knob.
+ * The positions are only approximations, good enough for effects which need the geometry.
+ */
+struct Key {
+  std::string_view name; // As used by edit_profile
+  std::uint8_t index;    // Position in the tables, e.g. in apply_colors_idle
+  std::uint8_t row;      // 0 is the row with Esc, 5 the one with space, 6 the remaining LEDs
+  float x, y;            // Center in key widths, relative to the top left corner of Esc
+  std::uint8_t column = 0; // Position in the row from the left. Filled in by Layout.
+};
+
+// Positions in the tables which don't have an LED on any known layout.
+inline constexpr std::array<std::uint8_t, 27> dead_slots = {
+    7,  8,  17, 26,  34,  35,  43,  44,  52,  53,  55,  62,  71, 75,
+    80, 89, 97, 98, 107, 108, 113, 114, 116, 122, 125, 134, 143};
+
+/** All LEDs of one keyboard layout.
+ *
+ * Everything is computed at compile time: Looking up a key by name uses a perfect hash (hash and
+ * displace: the first hash selects a bucket, every bucket has its own displacement which was
+ * chosen such that no two names end up in the same slot). Layouts with duplicate names, duplicate
+ * indices or keys on dead slots don't compile.
+ */
+template <std::size_t N>
+class Layout {
+  static_assert(N < 255);
+  static constexpr std::size_t buckets = 64;
+  static constexpr std::size_t slots   = 256;
+
+  std::array<Key, N> keys_ = {};
+  std::array<std::uint8_t, buckets> displacement = {};
+  // Position in keys_ plus one, zero if unused
+  std::array<std::uint8_t, slots> by_name = {};
+  std::array<std::uint8_t, 144> by_index  = {};
+
+  // FNV-1a
+  static constexpr std::uint64_t hash(std::string_view name) {
+    std::uint64_t hash = 0xcbf29ce484222325;
+    for (char c : name) {
+      hash ^= std::uint8_t(c);
+      hash *= 0x100000001b3;
+    }
+    return hash;
+  }
+  static constexpr std::size_t bucket(std::uint64_t hash) { return (hash >> 40) % buckets; }
+  // The step is odd and slots a power of two, so every slot can be reached.
+  static constexpr std::size_t slot(std::uint64_t hash, std::uint8_t displacement) {
+    return (std::uint32_t(hash) + displacement * (std::uint32_t(hash >> 16) | 1)) % slots;
+  }
+
+  consteval void init(std::span<const Key, N> keys) {
+    for (std::size_t i = 0; i != N; ++i) {
+      keys_[i] = keys[i];
+      for (std::size_t j = 0; j != i; ++j) {
+        if (keys[j].name == keys[i].name) throw std::invalid_argument("Duplicate key name");
+        if (keys[j].row == keys[i].row) ++keys_[i].column;
+      }
+      auto index = keys[i].index;
+      if (index >= by_index.size()) throw std::invalid_argument("Key index out of range");
+      if (by_index[index]) throw std::invalid_argument("Two keys share an index");
+      for (auto dead : dead_slots)
+        if (index == dead) throw std::invalid_argument("Key on a dead slot");
+      by_index[index] = i + 1;
+    }
+
+    std::array<std::size_t, buckets> bucket_size = {};
+    for (auto &key : keys_)
+      ++bucket_size[bucket(hash(key.name))];
+    // Buckets with many keys are the hardest to place, so they go first.
+    for (std::size_t size = N; size; --size) {
+      for (std::size_t b = 0; b != buckets; ++b) {
+        if (bucket_size[b] != size) continue;
+        bool placed = false;
+        for (unsigned d = 0; d != 256 && !placed; ++d) {
+          auto candidate = by_name;
+          placed         = true;
+          for (std::size_t i = 0; i != N && placed; ++i) {
+            auto h = hash(keys_[i].name);
+            if (bucket(h) != b) continue;
+            auto &entry = candidate[slot(h, d)];
+            if (entry) placed = false;
+            entry = i + 1;
+          }
+          if (!placed) continue;
+          by_name         = candidate;
+          displacement[b] = d;
+        }
+        if (!placed) throw std::invalid_argument("No perfect hash found");
+      }
+    }
+  }
+
+ public:
+  consteval explicit Layout(const Key (&keys)[N]) { init(keys); }
+  consteval explicit Layout(const std::array<Key, N> &keys) { init(keys); }
+
+  // In physical order: Row by row, from left to right
+  constexpr std::span<const Key, N> keys() const { return keys_; }
+  constexpr std::size_t size() const { return N; }
+
+  // The key with the given name or nullptr.
+  constexpr const Key *find(std::string_view name) const {
+    auto h     = hash(name);
+    auto entry = by_name[slot(h, displacement[bucket(h)])];
+    if (!entry || keys_[entry - 1].name != name) return nullptr;
+    return &keys_[entry - 1];
+  }
+  // The key at the given position in the tables or nullptr.
+  constexpr const Key *at(std::uint8_t index) const {
+    if (index >= by_index.size() || !by_index[index]) return nullptr;
+    return &keys_[by_index[index] - 1];
+  }
+};
+
+inline constexpr Key us_keys[] = {
+    {"esc", 45, 0, 0.5f, 0.5f},
+    {"f1", 27, 0, 2.5f, 0.5f},
+    {"f2", 18, 0, 3.5f, 0.5f},
+    {"f3", 9, 0, 4.5f, 0.5f},
+    {"f4", 14, 0, 5.5f, 0.5f},
+    {"f5", 0, 0, 7.0f, 0.5f},
+    {"f6", 5, 0, 8.0f, 0.5f},
+    {"f7", 90, 0, 9.0f, 0.5f},
+    {"f8", 95, 0, 10.0f, 0.5f},
+    {"f9", 77, 0, 11.5f, 0.5f},
+    {"f10", 63, 0, 12.5f, 0.5f},
+    {"f11", 68, 0, 13.5f, 0.5f},
+    {"f12", 54, 0, 14.5f, 0.5f},
+    {"print", 59, 0, 15.75f, 0.5f},
+    {"scrlk", 99, 0, 16.75f, 0.5f},
+    {"pause", 104, 0, 17.75f, 0.5f},
+    {"light", 111, 0, 19.0f, 0.5f},
+    {"play", 120, 0, 20.0f, 0.5f},
+    {"forward", 129, 0, 21.0f, 0.5f},
+    {"`", 46, 1, 0.5f, 2.0f},
+    {"1", 37, 1, 1.5f, 2.0f},
+    {"2", 28, 1, 2.5f, 2.0f},
+    {"3", 19, 1, 3.5f, 2.0f},
+    {"4", 10, 1, 4.5f, 2.0f},
+    {"5", 15, 1, 5.5f, 2.0f},
+    {"6", 1, 1, 6.5f, 2.0f},
+    {"7", 6, 1, 7.5f, 2.0f},
+    {"8", 91, 1, 8.5f, 2.0f},
+    {"9", 96, 1, 9.5f, 2.0f},
+    {"0", 81, 1, 10.5f, 2.0f},
+    {"-", 72, 1, 11.5f, 2.0f},
+    {"=", 64, 1, 12.5f, 2.0f},
+    {"backspace", 60, 1, 14.0f, 2.0f},
+    {"ins", 61, 1, 15.75f, 2.0f},
+    {"home", 105, 1, 16.75f, 2.0f},
+    {"page_up", 106, 1, 17.75f, 2.0f},
+    {"num", 102, 1, 19.0f, 2.0f},
+    {"num_divide", 110, 1, 20.0f, 2.0f},
+    {"num_mult", 128, 1, 21.0f, 2.0f},
+    {"num_minus", 119, 1, 22.0f, 2.0f},
+    {"tab", 47, 2, 0.75f, 3.0f},
+    {"q", 38, 2, 2.0f, 3.0f},
+    {"w", 29, 2, 3.0f, 3.0f},
+    {"e", 20, 2, 4.0f, 3.0f},
+    {"r", 11, 2, 5.0f, 3.0f},
+    {"t", 16, 2, 6.0f, 3.0f},
+    {"y", 2, 2, 7.0f, 3.0f},
+    {"u", 92, 2, 8.0f, 3.0f},
+    {"i", 82, 2, 9.0f, 3.0f},
+    {"o", 87, 2, 10.0f, 3.0f},
+    {"p", 73, 2, 11.0f, 3.0f},
+    {"[", 65, 2, 12.0f, 3.0f},
+    {"]", 69, 2, 13.0f, 3.0f},
+    {"\\", 56, 2, 14.25f, 3.0f},
+    {"del", 101, 2, 15.75f, 3.0f},
+    {"end", 103, 2, 16.75f, 3.0f},
+    {"page_down", 100, 2, 17.75f, 3.0f},
+    {"num_7", 142, 2, 19.0f, 3.0f},
+    {"num_8", 115, 2, 20.0f, 3.0f},
+    {"num_9", 133, 2, 21.0f, 3.0f},
+    {"caps_lock", 48, 3, 0.875f, 4.0f},
+    {"a", 39, 3, 2.25f, 4.0f},
+    {"s", 30, 3, 3.25f, 4.0f},
+    {"d", 21, 3, 4.25f, 4.0f},
+    {"f", 25, 3, 5.25f, 4.0f},
+    {"g", 12, 3, 6.25f, 4.0f},
+    {"h", 3, 3, 7.25f, 4.0f},
+    {"j", 93, 3, 8.25f, 4.0f},
+    {"k", 83, 3, 9.25f, 4.0f},
+    {"l", 84, 3, 10.25f, 4.0f},
+    {";", 74, 3, 11.25f, 4.0f},
+    {"'", 66, 3, 12.25f, 4.0f},
+    {"enter", 58, 3, 13.875f, 4.0f},
+    {"num_4", 139, 3, 19.0f, 4.0f},
+    {"num_5", 112, 3, 20.0f, 4.0f},
+    {"num_6", 130, 3, 21.0f, 4.0f},
+    {"num_plus", 124, 3, 22.0f, 3.5f},
+    {"left_shift", 49, 4, 1.125f, 5.0f},
+    {"z", 31, 4, 2.75f, 5.0f},
+    {"x", 33, 4, 3.75f, 5.0f},
+    {"c", 24, 4, 4.75f, 5.0f},
+    {"v", 22, 4, 5.75f, 5.0f},
+    {"b", 13, 4, 6.75f, 5.0f},
+    {"n", 4, 4, 7.75f, 5.0f},
+    {"m", 94, 4, 8.75f, 5.0f},
+    {",", 85, 4, 9.75f, 5.0f},
+    {".", 86, 4, 10.75f, 5.0f},
+    {"/", 76, 4, 11.75f, 5.0f},
+    {"right_shift", 70, 4, 13.625f, 5.0f},
+    {"up", 135, 4, 16.75f, 5.0f},
+    {"num_1", 136, 4, 19.0f, 5.0f},
+    {"num_2", 109, 4, 20.0f, 5.0f},
+    {"num_3", 127, 4, 21.0f, 5.0f},
+    {"left_ctrl", 50, 5, 0.625f, 6.0f},
+    {"meta", 41, 5, 1.875f, 6.0f},
+    {"left_alt", 32, 5, 3.125f, 6.0f},
+    {"space", 23, 5, 6.875f, 6.0f},
+    {"right_alt", 88, 5, 10.625f, 6.0f},
+    {"fn", 79, 5, 11.875f, 6.0f},
+    {"menu", 78, 5, 13.125f, 6.0f},
+    {"right_ctrl", 67, 5, 14.375f, 6.0f},
+    {"left", 140, 5, 15.75f, 6.0f},
+    {"down", 137, 5, 16.75f, 6.0f},
+    {"right", 138, 5, 17.75f, 6.0f},
+    {"num_0", 141, 5, 19.5f, 6.0f},
+    {"num_dot", 132, 5, 21.0f, 6.0f},
+    {"num_enter", 121, 5, 22.0f, 5.5f},
+    {"left_light_top", 36, 6, -0.5f, 1.5f},
+    {"left_light_bottom", 42, 6, -0.5f, 5.0f},
+    {"right_light_top", 123, 6, 23.0f, 1.5f},
+    {"right_light_bottom", 51, 6, 23.0f, 5.0f},
+    {"volume_top_left", 117, 6, 21.75f, 0.25f},
+    {"volume_top_right", 126, 6, 22.25f, 0.25f},
+    {"volume_bottom_right", 118, 6, 22.25f, 0.75f},
+    {"volume_bottom_left", 131, 6, 21.75f, 0.75f},
+};
+
+// The UK layout has two additional keys: # left of enter and \ right of the left shift key.
+consteval std::array<Key, std::size(us_keys) + 2> make_uk_keys() {
+  std::array<Key, std::size(us_keys) + 2> keys = {};
+  std::size_t n                                 = 0;
+  for (auto key : us_keys) {
+    if (key.name == "enter") {
+      keys[n++] = {"non_us_hash", 57, key.row, 13.25f, key.y};
+      key.x     = 14.375f;
+    }
+    if (key.name == "left_shift") {
+      key.x     = 0.625f;
+      keys[n++] = key;
+      keys[n++] = {"non_us_backslash", 40, key.row, 1.75f, key.y};
+      continue;
+    }
+    keys[n++] = key;
+  }
+  return keys;
+}
+
+inline constexpr Layout us_layout(us_keys);
+inline constexpr Layout uk_layout(make_uk_keys());
+
+// 144 slots, but only 115 LEDs on US keyboards.
+static_assert(us_layout.size() + 2 + dead_slots.size() == 144);
+static_assert(us_layout.find("esc")->index == 45 && uk_layout.at(40)->name == "non_us_backslash");
+} // namespace mfk
+#endif
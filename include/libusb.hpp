@@ -25,10 +25,14 @@
 
 #include <cassert>
 #include <chrono>
+#include <cstdint>
+#include <functional>
 #include <libusb.h>
 #include <memory>
+#include <new>
 #include <span>
 #include <system_error>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
@@ -49,16 +53,30 @@ class Device {
  public:
   class Handle {
     struct Deleter {
-      void operator()(libusb_device_handle *ptr) noexcept { libusb_close(ptr); }
+      int fd; // Only for wrapped file descriptors (otherwise -1), libusb_close keeps them open.
+      void operator()(libusb_device_handle *ptr) noexcept {
+        libusb_close(ptr);
+        if (fd >= 0) ::close(fd);
+      }
     };
     std::unique_ptr<libusb_device_handle, Deleter> handle;
 
    public:
-    Handle(const Device &device) {
+    Handle(const Device &device): handle(nullptr, Deleter{-1}) {
       libusb_device_handle *dev;
       if (int err = libusb_open(device, &dev)) throw std::system_error(err, libusb_error_category);
       handle.reset(dev);
     }
+    // Takes ownership of fd, an open usbfs device node like /dev/bus/usb/001/004. Unlike
+    // opening a Device this needs no device list, so nothing has to be enumerated.
+    Handle(libusb_context *context, int fd): handle(nullptr, Deleter{fd}) {
+      libusb_device_handle *dev;
+      if (int err = libusb_wrap_sys_device(context, fd, &dev)) {
+        ::close(fd);
+        throw std::system_error(err, libusb_error_category);
+      }
+      handle.reset(dev);
+    }
     operator libusb_device_handle *() const noexcept { return handle.get(); }
     void claim(int interface) {
       if (int err = libusb_claim_interface(handle.get(), interface))
@@ -118,8 +136,94 @@ class Device {
     return std::unique_ptr<libusb_config_descriptor, ConfigDescriptionDeleter>(desc);
   }
 
+  std::uint8_t bus_number() const noexcept { return libusb_get_bus_number(dev); }
+  std::uint8_t address() const noexcept { return libusb_get_device_address(dev); }
+  // The ports from the root hub to the device, as used in sysfs: bus_number-ports[0].ports[1]...
+  std::vector<std::uint8_t> port_numbers() const {
+    std::uint8_t ports[7]; // USB limits the depth to 7
+    auto count = libusb_get_port_numbers(dev, ports, std::size(ports));
+    if (count < 0) throw std::system_error(count, libusb_error_category);
+    return std::vector(ports, ports + count);
+  }
+
   Handle open() { return Handle(*this); }
 };
+
+// An asynchronous transfer. The buffer and the callback have to stay alive until the transfer
+// completed (or got cancelled), which is signaled by calling the callback from inside
+// Context::handle_events.
+class Transfer {
+  struct Deleter {
+    void operator()(libusb_transfer *ptr) noexcept { libusb_free_transfer(ptr); }
+  };
+  std::unique_ptr<libusb_transfer, Deleter> transfer;
+
+ public:
+  Transfer(): transfer(libusb_alloc_transfer(0)) {
+    if (!transfer) throw std::bad_alloc();
+  }
+  operator libusb_transfer *() const noexcept { return transfer.get(); }
+  libusb_transfer *operator->() const noexcept { return transfer.get(); }
+
+  void fill_interrupt(const Device::Handle &handle, std::uint8_t endpoint,
+                      std::span<const std::byte> data, libusb_transfer_cb_fn callback,
+                      void *user_data,
+                      std::chrono::duration<unsigned int, std::ratio<1, 1000>> timeout = {}) {
+    libusb_fill_interrupt_transfer(
+        transfer.get(), handle, endpoint,
+        reinterpret_cast<unsigned char *>(const_cast<std::byte *>(data.data())), data.size(),
+        callback, user_data, timeout.count());
+  }
+  void submit() {
+    if (int err = libusb_submit_transfer(transfer.get()))
+      throw std::system_error(err, libusb_error_category);
+  }
+  // Returns false if the transfer was not in progress
+  bool cancel() noexcept { return LIBUSB_SUCCESS == libusb_cancel_transfer(transfer.get()); }
+};
+/** A registered hotplug callback. Deregisters itself when destroyed.
+ *
+ * The callback is called from Context::handle_events on whichever thread calls it. It must not
+ * call libusb functions which do I/O, in particular it can't open the device.
+ */
+class Hotplug {
+ public:
+  enum class Event {
+    Arrived = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+    Left    = LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT
+  };
+  using Callback = std::function<void(Event, const Device &)>;
+
+ private:
+  libusb_context *context = nullptr;
+  libusb_hotplug_callback_handle handle{};
+  // On the heap since libusb keeps a pointer to it
+  std::unique_ptr<Callback> callback;
+
+  static int LIBUSB_CALL dispatch(libusb_context *, libusb_device *device,
+                                  libusb_hotplug_event event, void *user_data) {
+    (*static_cast<Callback *>(user_data))(Event(event), Device(libusb_ref_device(device)));
+    return 0; // Stay registered
+  }
+
+ public:
+  Hotplug(libusb_context *context, std::uint16_t vid, std::uint16_t pid, Callback callback):
+      context(context), callback(std::make_unique<Callback>(std::move(callback))) {
+    if (int err = libusb_hotplug_register_callback(
+            context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_NO_FLAGS, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, dispatch,
+            this->callback.get(), &handle))
+      throw std::system_error(err, libusb_error_category);
+  }
+  Hotplug(Hotplug &&other) noexcept:
+      context(std::exchange(other.context, nullptr)), handle(other.handle),
+      callback(std::move(other.callback)) {}
+  Hotplug &operator=(Hotplug &&) = delete;
+  ~Hotplug() {
+    if (context) libusb_hotplug_deregister_callback(context, handle);
+  }
+};
+
 class Context {
   struct Deleter {
     void operator()(libusb_context *ptr) noexcept { libusb_exit(ptr); }
@@ -133,6 +237,42 @@ class Context {
     handle.reset(context);
   }
   operator libusb_context *() const noexcept { return handle.get(); }
+  // Run completion callbacks of asynchronous transfers. Waits at most timeout for any event.
+  void handle_events(std::chrono::microseconds timeout = {}) {
+    timeval tv{static_cast<time_t>(timeout.count() / 1000000),
+               static_cast<suseconds_t>(timeout.count() % 1000000)};
+    if (int err = libusb_handle_events_timeout_completed(handle.get(), &tv, nullptr))
+      throw std::system_error(err, libusb_error_category);
+  }
+  // Not every platform supports hotplug events, check before calling on_hotplug.
+  static bool has_hotplug() noexcept { return libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG); }
+  // Call callback whenever a device with the given ids gets connected or disconnected.
+  Hotplug on_hotplug(std::uint16_t vid, std::uint16_t pid, Hotplug::Callback callback) {
+    return Hotplug(handle.get(), vid, pid, std::move(callback));
+  }
+  // The file descriptors libusb waits on. An event loop has to call handle_events once any of
+  // them is ready.
+  std::vector<libusb_pollfd> pollfds() const {
+    const libusb_pollfd **list = libusb_get_pollfds(handle.get());
+    if (!list) throw std::system_error(LIBUSB_ERROR_NO_MEM, libusb_error_category);
+    std::vector<libusb_pollfd> result;
+    try {
+      for (auto entry = list; *entry; ++entry)
+        result.push_back(**entry);
+    } catch (...) {
+      libusb_free_pollfds(list);
+      throw;
+    }
+    libusb_free_pollfds(list);
+    return result;
+  }
+  // Get notified whenever pollfds() changes. Pass nullptr to stop.
+  void on_pollfds_changed(libusb_pollfd_added_cb added, libusb_pollfd_removed_cb removed,
+                          void *user_data) {
+    libusb_set_pollfd_notifiers(handle.get(), added, removed, user_data);
+  }
+  // Open a device node of usbfs directly, see Device::Handle.
+  Device::Handle wrap(int fd) { return Device::Handle(handle.get(), fd); }
   std::vector<Device> list() const {
     libusb_device **list;
     auto count = libusb_get_device_list(handle.get(), &list);
@@ -0,0 +1,168 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_MANAGER_HPP
+#define X50Q_MANAGER_HPP
+#include "x50q.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace mfk {
+/** Drives every connected keyboard in parallel.
+ *
+ * Each keyboard gets its own I/O thread, so a command takes as long as it takes on the slowest
+ * keyboard instead of the sum over all of them. The X50Q objects are only ever used from their
+ * own thread, so the functions passed to run_all() must not keep references to them.
+ */
+class KeyboardManager {
+ public:
+  using clock = std::chrono::steady_clock;
+
+ private:
+  class Worker {
+    X50Q device;
+    std::string location_;
+    std::mutex mutex;
+    std::condition_variable_any wakeup;
+    std::deque<std::packaged_task<void()>> jobs;
+    std::jthread thread; // Must be the last member, so it is stopped first
+
+    void run(std::stop_token stop) {
+      while (true) {
+        std::packaged_task<void()> job;
+        {
+          std::unique_lock lock(mutex);
+          if (!wakeup.wait(lock, stop, [&] { return !jobs.empty(); })) return;
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        }
+        job();
+      }
+    }
+
+   public:
+    explicit Worker(const X50Q::DeviceInfo &info):
+        device(info), location_(info.location), thread([this](std::stop_token stop) {
+          run(std::move(stop));
+        }) {}
+    // E.g. for a simulated keyboard
+    Worker(std::unique_ptr<Transport> transport, std::string location):
+        device(std::move(transport)), location_(std::move(location)),
+        thread([this](std::stop_token stop) { run(std::move(stop)); }) {}
+
+    const std::string &location() const { return location_; }
+
+    std::future<void> post(std::function<void(X50Q &)> fn) {
+      std::packaged_task<void()> job([this, fn = std::move(fn)] { fn(device); });
+      auto result = job.get_future();
+      {
+        std::lock_guard lock(mutex);
+        jobs.push_back(std::move(job));
+      }
+      wakeup.notify_one();
+      return result;
+    }
+  };
+  std::vector<std::unique_ptr<Worker>> workers;
+
+  static std::vector<std::exception_ptr> wait_all(std::vector<std::future<void>> &results) {
+    std::vector<std::exception_ptr> errors(results.size());
+    for (std::size_t i = 0; i != results.size(); ++i) {
+      try {
+        results[i].get();
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+    return errors;
+  }
+
+ public:
+  // Opens all keyboards returned by X50Q::enumerate
+  explicit KeyboardManager(std::uint16_t vid = 0x24f0, std::uint16_t pid = 0x202b) {
+    for (auto &&info : X50Q::enumerate(vid, pid))
+      workers.push_back(std::make_unique<Worker>(info));
+  }
+  // Drives the given transports instead, e.g. SimulatedX50Q. Their locations are their indices.
+  explicit KeyboardManager(std::vector<std::unique_ptr<Transport>> transports) {
+    for (std::size_t i = 0; i != transports.size(); ++i)
+      workers.push_back(std::make_unique<Worker>(std::move(transports[i]), std::to_string(i)));
+  }
+
+  std::size_t size() const { return workers.size(); }
+  // Position of the i-th keyboard on the bus, stable across restarts as long as no cables are
+  // moved.
+  const std::string &location(std::size_t i) const { return workers.at(i)->location(); }
+
+  // Queue fn for the i-th keyboard without waiting for it.
+  std::future<void> post(std::size_t i, std::function<void(X50Q &)> fn) {
+    return workers.at(i)->post(std::move(fn));
+  }
+
+  /** Run fn on all keyboards at the same time and wait until all are done.
+   *
+   * Returns one entry per keyboard, which is null if fn succeeded and the exception otherwise.
+   */
+  std::vector<std::exception_ptr> run_all(std::function<void(X50Q &)> fn) {
+    std::vector<std::future<void>> results;
+    for (auto &worker : workers) results.push_back(worker->post(fn));
+    return wait_all(results);
+  }
+
+  /** Upload one color frame per keyboard, all with a common deadline.
+   *
+   * Commands which don't make it in time fail with a TimeoutError for that keyboard only, the
+   * others still show their new frame. table has to be ColorsIdle or ColorsActive.
+   */
+  std::vector<std::exception_ptr> present(std::span<const std::uint8_t[3][144]> frames,
+                                          clock::time_point deadline,
+                                          X50Q::Table table = X50Q::Table::ColorsIdle) {
+    assert(frames.size() == workers.size());
+    assert(table == X50Q::Table::ColorsIdle || table == X50Q::Table::ColorsActive);
+    std::vector<std::future<void>> results;
+    for (std::size_t i = 0; i != workers.size(); ++i)
+      results.push_back(workers[i]->post([&frame = frames[i], deadline, table](X50Q &device) {
+        auto scope = device.deadline_scope(deadline);
+        device.apply_blocks(table, std::as_bytes(std::span(frame)));
+      }));
+    return wait_all(results);
+  }
+};
+} // namespace mfk
+
+#endif
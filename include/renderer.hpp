@@ -0,0 +1,169 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_RENDERER_HPP
+#define X50Q_RENDERER_HPP
+#include "color.hpp"
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+
+namespace mfk {
+/** Drives a frame function at a fixed frame rate.
+ *
+ * Frames are scheduled at absolute deadlines (start + n * period), so timing errors don't add
+ * up like they do with a sleep in a loop. If the previous frame is still being uploaded when the
+ * next deadline arrives, the frame is dropped instead of queued. If we wake up after more than
+ * a whole period, the deadlines which passed in between are skipped.
+ */
+class Renderer {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  struct FrameInfo {
+    std::uint64_t frame;         // Number of the deadline, including dropped ones
+    clock::duration time;        // Deadline relative to the start of the animation
+    clock::duration since_last;  // Time since the last rendered frame
+  };
+  // Fills the colors for a frame. Returning false stops the animation.
+  using FrameFunction = std::function<bool(std::uint8_t (&)[3][144], const FrameInfo &)>;
+
+  enum class Target { Idle = 1, Active = 2, Both = 3 };
+
+  struct Statistics {
+    std::uint64_t frames_presented = 0;
+    std::uint64_t frames_dropped   = 0; // Previous upload was still in progress
+    std::uint64_t deadlines_missed = 0; // Woke up so late that whole periods were skipped
+    double fps                     = 0; // Presented frames per second
+    clock::duration mean_jitter{};      // Mean lateness of the frame start
+    clock::duration max_jitter{};
+  };
+
+ private:
+  X50Q &device;
+  clock::duration period;
+  Target target;
+  std::atomic<bool> stopped = false;
+  Statistics stats;
+  clock::duration total_jitter{};
+  std::uint8_t colors[3][144] = {};
+  const ColorCorrection *correction = nullptr;
+  std::uint8_t corrected[3][144]    = {};
+
+ public:
+  Renderer(X50Q &device, double fps, Target target = Target::Idle):
+      device(device),
+      period(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1 / fps))),
+      target(target) {
+    assert(fps > 0);
+  }
+
+  // Can be called from the frame function or from a different thread.
+  void stop() { stopped = true; }
+
+  const Statistics &statistics() const { return stats; }
+
+  // Correct every frame before it gets uploaded. The frame function still sees the uncorrected
+  // colors. correction has to stay alive while run() is running, nullptr disables it.
+  void set_color_correction(const ColorCorrection *correction) { this->correction = correction; }
+
+  /** Run the animation until the frame function returns false or stop() gets called. */
+  void run(FrameFunction render) {
+    stopped      = false;
+    stats        = {};
+    total_jitter = {};
+    unsigned pending = 0; // Uploads of the last frame still in progress
+    std::exception_ptr error;
+    auto done = [&](std::exception_ptr e, const X50Q::Response &) {
+      --pending;
+      if (e && !error) error = std::move(e);
+    };
+
+    // done refers to pending and error, so no upload may outlive this function. Failed uploads
+    // still call done, and flush() only throws once nothing is pending anymore.
+    try {
+      const auto start = clock::now();
+      auto last_frame  = start;
+      for (std::uint64_t frame = 0; !stopped; ++frame) {
+        auto deadline = start + period * clock::rep(frame);
+        // Keep serving the device while we wait
+        for (auto now = clock::now(); now < deadline; now = clock::now()) {
+          auto remaining = std::chrono::floor<std::chrono::milliseconds>(deadline - now);
+          device.poll(remaining);
+          if (remaining == remaining.zero()) std::this_thread::sleep_until(deadline);
+        }
+        if (error) break;
+
+        auto now  = clock::now();
+        auto late = now - deadline;
+        if (late >= period) {
+          auto skipped = std::uint64_t(late / period);
+          stats.deadlines_missed += skipped;
+          frame += skipped;
+          deadline += period * clock::rep(skipped);
+          late = now - deadline;
+        }
+        if (pending) {
+          ++stats.frames_dropped;
+          continue;
+        }
+        stats.max_jitter = std::max(stats.max_jitter, late);
+        total_jitter += late;
+
+        if (!render(colors, FrameInfo{frame, deadline - start, now - last_frame})) break;
+        last_frame = now;
+        auto &upload = correction ? corrected : colors;
+        if (correction) correction->apply(colors, corrected);
+        if (int(target) & int(Target::Idle)) {
+          ++pending;
+          device.apply_colors_idle_async(upload, done);
+        }
+        if (int(target) & int(Target::Active)) {
+          ++pending;
+          device.apply_colors_active_async(upload, done);
+        }
+        ++stats.frames_presented;
+        stats.mean_jitter = total_jitter / stats.frames_presented;
+        if (now != start)
+          stats.fps =
+              (stats.frames_presented - 1) / std::chrono::duration<double>(now - start).count();
+      }
+    } catch (...) {
+      try {
+        device.flush();
+      } catch (...) {}
+      throw;
+    }
+    device.flush();
+    if (error) std::rethrow_exception(error);
+  }
+};
+} // namespace mfk
+#endif
@@ -0,0 +1,191 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_SHADOW_HPP
+#define X50Q_SHADOW_HPP
+#include "x50q.hpp"
+
+#include <bitset>
+#include <cstring>
+#include <exception>
+#include <span>
+#include <utility>
+
+namespace mfk {
+/** Local mirror of the tables stored on the keyboard.
+ *
+ * The keyboard can't be queried, so we remember what we sent instead. All changes are made to
+ * the local copy and commit() only uploads the 60 byte blocks which differ from the last upload.
+ * Changing a single key color therefore sends 3 blocks instead of 8.
+ *
+ * Everything starts out unknown, so the first commit() uploads all tables.
+ */
+class ShadowState {
+ public:
+  enum class Granularity {
+    Blocks, // Only send the blocks which changed
+    Tables  // Send the whole table if anything in it changed
+  };
+
+  struct Tables {
+    ByteSeconds active_duration[144];
+    X50Q::Effect effects_active[144];
+    std::uint8_t colors_active[3][144];
+    X50Q::Effect effects_idle[144];
+    std::uint8_t colors_idle[3][144];
+  };
+
+ private:
+  X50Q &device;
+  Granularity granularity;
+  Tables wanted   = {};
+  Tables uploaded = {};
+  std::bitset<5> known;
+
+  // Same order as Profile::apply
+  static constexpr std::array<X50Q::Table, 5> upload_order = {
+      X50Q::Table::ActiveDuration, X50Q::Table::EffectsActive, X50Q::Table::ColorsActive,
+      X50Q::Table::EffectsIdle, X50Q::Table::ColorsIdle};
+
+  static std::span<std::byte> bytes(Tables &tables, X50Q::Table table) {
+    switch (table) {
+    case X50Q::Table::ColorsIdle: return as_writable_bytes(std::span(tables.colors_idle));
+    case X50Q::Table::ColorsActive: return as_writable_bytes(std::span(tables.colors_active));
+    case X50Q::Table::EffectsIdle: return as_writable_bytes(std::span(tables.effects_idle));
+    case X50Q::Table::EffectsActive: return as_writable_bytes(std::span(tables.effects_active));
+    case X50Q::Table::ActiveDuration: return as_writable_bytes(std::span(tables.active_duration));
+    }
+    assert(false);
+    return {};
+  }
+
+  X50Q::BlockMask dirty_blocks(std::size_t i) {
+    auto table   = upload_order[i];
+    auto current = bytes(wanted, table);
+    auto old     = bytes(uploaded, table);
+    X50Q::BlockMask blocks;
+    for (std::size_t block = 0; 60 * block < current.size(); ++block) {
+      auto offset = 60 * block;
+      auto length = std::min<std::size_t>(60, current.size() - offset);
+      if (!known[i] || std::memcmp(current.data() + offset, old.data() + offset, length))
+        blocks.set(block);
+    }
+    return blocks;
+  }
+
+  // Queue blocks of the i-th table of uploaded. If that fails, the table is unknown again.
+  void upload(std::size_t i, X50Q::BlockMask blocks, std::exception_ptr &first_error) {
+    known.set(i);
+    device.apply_blocks_async(upload_order[i], bytes(uploaded, upload_order[i]), blocks,
+                              [this, i, &first_error](std::exception_ptr error,
+                                                      const X50Q::Response &) {
+                                if (!error) return;
+                                known.reset(i);
+                                if (!first_error) first_error = std::move(error);
+                              });
+  }
+
+ public:
+  explicit ShadowState(X50Q &device, Granularity granularity = Granularity::Blocks):
+      device(device), granularity(granularity) {}
+
+  X50Q &x50q() { return device; }
+
+  // The state which will be uploaded by the next commit(). Can be modified freely.
+  Tables &tables() { return wanted; }
+  const Tables &tables() const { return wanted; }
+
+  void set_color_idle(std::uint8_t key, std::uint8_t r, std::uint8_t g, std::uint8_t b) {
+    assert(key < 144);
+    wanted.colors_idle[0][key] = r;
+    wanted.colors_idle[1][key] = g;
+    wanted.colors_idle[2][key] = b;
+  }
+  void set_color_active(std::uint8_t key, std::uint8_t r, std::uint8_t g, std::uint8_t b) {
+    assert(key < 144);
+    wanted.colors_active[0][key] = r;
+    wanted.colors_active[1][key] = g;
+    wanted.colors_active[2][key] = b;
+  }
+  void set_effect_idle(std::uint8_t key, X50Q::Effect effect) {
+    assert(key < 144);
+    wanted.effects_idle[key] = effect;
+  }
+  void set_effect_active(std::uint8_t key, X50Q::Effect effect) {
+    assert(key < 144);
+    wanted.effects_active[key] = effect;
+  }
+  void set_active_duration(std::uint8_t key, ByteSeconds duration) {
+    assert(key < 144);
+    wanted.active_duration[key] = duration;
+  }
+
+  /** Forget what is stored on the keyboard.
+   *
+   * Has to be called whenever the keyboard might have changed behind our back, e.g. after
+   * set_builtin or after it got reconnected. The next commit() uploads everything.
+   */
+  void invalidate() { known.reset(); }
+
+  /** Upload all changes since the last commit.
+   *
+   * The tables are queued together, so their blocks get pipelined. If an upload fails, the
+   * affected table is considered unknown and the error is rethrown.
+   */
+  void commit() {
+    std::exception_ptr first_error;
+    for (std::size_t i = 0; i != upload_order.size(); ++i) {
+      auto blocks = dirty_blocks(i);
+      if (blocks.none()) continue;
+      if (granularity == Granularity::Tables) blocks.set();
+      std::ranges::copy(bytes(wanted, upload_order[i]), bytes(uploaded, upload_order[i]).begin());
+      upload(i, blocks, first_error);
+    }
+    device.flush();
+    if (first_error) std::rethrow_exception(first_error);
+  }
+
+  /** Upload the last committed state again, e.g. after the keyboard lost power.
+   *
+   * All tables are sent as one pipelined burst. Tables which were never committed are skipped
+   * and uncommitted changes are left for the next commit().
+   */
+  void restore() {
+    std::exception_ptr first_error;
+    auto restored = std::exchange(known, {});
+    for (std::size_t i = 0; i != upload_order.size(); ++i)
+      if (restored[i]) upload(i, X50Q::BlockMask().set(), first_error);
+    device.flush();
+    if (first_error) std::rethrow_exception(first_error);
+  }
+
+  // Call restore() whenever the device gets reconnected. Replaces the callback set with
+  // X50Q::on_reconnect.
+  void restore_on_reconnect() {
+    device.on_reconnect([this] { restore(); });
+  }
+};
+} // namespace mfk
+#endif
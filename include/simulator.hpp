@@ -0,0 +1,265 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_SIMULATOR_HPP
+#define X50Q_SIMULATOR_HPP
+#include "x50q.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <span>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+namespace mfk {
+/** An X50Q which only exists in memory.
+ *
+ * Implements the protocol as observed on the real keyboard, such that everything above the
+ * Transport can be tested and benchmarked without one:
+ *
+ *   X50Q dev(std::make_unique<SimulatedX50Q>());
+ *
+ * Every valid packet gets acknowledged after latency plus a random delay of up to jitter.
+ * Acknowledgements are sent in order. Invalid packets are counted and never acknowledged.
+ */
+class SimulatedX50Q final : public Transport {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  struct Timing {
+    std::chrono::microseconds latency{1000};
+    std::chrono::microseconds jitter{0};
+    // set_builtin_(0) is very slow on the real keyboard
+    std::chrono::milliseconds reset_delay{4000};
+  };
+
+ private:
+  using Report = std::array<std::byte, 9>;
+  struct Pending {
+    clock::time_point due;
+    Report report;
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<Pending> pending; // Sorted by due. Short, and keeps its storage unlike a deque.
+  // Expires when the first pending report is due, see fd()
+  int timer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  clock::time_point last_ack;
+  Timing timing = {};
+  std::minstd_rand random;
+
+  std::uint8_t profile_          = 1;
+  std::uint8_t firmware_version_ = 0x40;
+  std::array<std::array<std::byte, 3 * 144>, 5> tables = {};
+  std::uint64_t packets_         = 0;
+  std::uint64_t invalid_packets_ = 0;
+  bool stalled                   = false;
+
+  static std::size_t table_index(X50Q::Table table) {
+    switch (table) {
+    case X50Q::Table::ColorsIdle: return 0;
+    case X50Q::Table::ColorsActive: return 1;
+    case X50Q::Table::EffectsIdle: return 2;
+    case X50Q::Table::EffectsActive: return 3;
+    case X50Q::Table::ActiveDuration: return 4;
+    }
+    assert(false);
+    return 0;
+  }
+
+  // Has to be called with mutex held. steady_clock is CLOCK_MONOTONIC.
+  void arm_timer() {
+    if (timer < 0) return;
+    itimerspec spec = {};
+    if (!pending.empty()) {
+      auto due              = pending.front().due.time_since_epoch();
+      auto seconds          = std::chrono::floor<std::chrono::seconds>(due);
+      spec.it_value.tv_sec  = seconds.count();
+      spec.it_value.tv_nsec = std::max<long>(1, (due - seconds) / std::chrono::nanoseconds(1));
+    }
+    ::timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr);
+  }
+
+  // Has to be called with mutex held
+  void queue(clock::time_point due, Report report) {
+    auto pos = std::ranges::upper_bound(pending, due, {}, &Pending::due);
+    const bool first = pos == pending.begin();
+    pending.insert(pos, {due, report});
+    if (first) arm_timer();
+    changed.notify_all();
+  }
+
+  void acknowledge(std::span<const std::byte> payload, clock::duration extra_delay = {}) {
+    clock::duration delay = timing.latency + extra_delay;
+    if (timing.jitter.count())
+      delay += std::chrono::microseconds(std::uniform_int_distribution<std::int64_t>(
+          0, timing.jitter.count())(random));
+    last_ack     = std::max(last_ack, clock::now() + delay);
+    Report reply = {std::byte(8), std::byte(0)};
+    std::ranges::copy(payload, reply.begin() + 2);
+    queue(last_ack, reply);
+  }
+
+ public:
+  SimulatedX50Q() = default;
+  explicit SimulatedX50Q(Timing timing, unsigned seed = 1): timing(timing), random(seed) {}
+  ~SimulatedX50Q() override {
+    if (timer >= 0) ::close(timer);
+  }
+
+  void set_timing(Timing new_timing) {
+    std::lock_guard lock(mutex);
+    timing = new_timing;
+  }
+
+  void send(std::span<const std::byte, 64> packet, std::chrono::milliseconds) override {
+    std::lock_guard lock(mutex);
+    ++packets_;
+    if (stalled) return;
+    if (packet[0] != std::byte(7)) {
+      ++invalid_packets_;
+      return;
+    }
+    auto cmd = packet[1];
+    switch (cmd) {
+    case std::byte(0x81): {
+      std::array<std::byte, 7> status = {std::byte(8), cmd, std::byte(profile_), std::byte(0),
+                                         std::byte(firmware_version_)};
+      acknowledge(status);
+    } break;
+    case std::byte(0x01): {
+      auto index = std::uint8_t(packet[2]);
+      if (index > 6) {
+        ++invalid_packets_;
+        return;
+      }
+      if (index) profile_ = index;
+      acknowledge(std::array{std::byte(8), cmd},
+                  index ? clock::duration() : clock::duration(timing.reset_delay));
+    } break;
+    case std::byte(0x09):
+    case std::byte(0x0a):
+    case std::byte(0x0d):
+    case std::byte(0x0e):
+    case std::byte(0x0f): {
+      auto table  = X50Q::Table(cmd);
+      auto offset = 60 * std::size_t(packet[3]);
+      auto size   = X50Q::table_size(table);
+      if (packet[2] != std::byte(0x06) || offset >= size) {
+        ++invalid_packets_;
+        return;
+      }
+      auto block = packet.subspan(4, std::min<std::size_t>(60, size - offset));
+      std::ranges::copy(block, tables[table_index(table)].begin() + offset);
+      acknowledge(std::array{std::byte(8), cmd});
+    } break;
+    default: ++invalid_packets_; return;
+    }
+  }
+
+  void reap() override {}
+  void cancel() override {}
+
+  std::span<std::byte> read(std::span<std::byte> buffer,
+                            std::chrono::milliseconds timeout) override {
+    std::unique_lock lock(mutex);
+    const auto give_up = clock::now() + timeout;
+    while (true) {
+      auto now = clock::now();
+      if (!pending.empty() && pending.front().due <= now) {
+        auto report = pending.front().report;
+        pending.erase(pending.begin());
+        arm_timer();
+        auto length = std::min(buffer.size(), report.size());
+        std::copy_n(report.begin(), length, buffer.begin());
+        return buffer.subspan(0, length);
+      }
+      if (now >= give_up) return {};
+      changed.wait_until(lock, pending.empty() ? give_up : std::min(give_up, pending.front().due));
+    }
+  }
+
+  int fd() const override { return timer; }
+
+  // While stalled, packets are received but neither processed nor acknowledged, like on a
+  // wedged keyboard.
+  void stall(bool stall = true) {
+    std::lock_guard lock(mutex);
+    stalled = stall;
+  }
+
+  // Simulate the user selecting a builtin profile with the fn key
+  void press_profile_key(std::uint8_t profile) {
+    assert(profile > 0 && profile <= 6);
+    std::lock_guard lock(mutex);
+    profile_ = profile;
+    queue(clock::now(), {std::byte(8), std::byte(2), std::byte(0x03), std::byte(0x24),
+                         std::byte(0xf0), std::byte(0x20), std::byte(0x2b), std::byte(profile)});
+  }
+
+  // Simulate the volume knob
+  void turn_volume(bool up) {
+    std::lock_guard lock(mutex);
+    queue(clock::now(), {std::byte(8), std::byte(0x67), std::byte(0x0c), std::byte(0x07),
+                         std::byte(0x73), std::byte(up)});
+  }
+
+  // Send an arbitrary report, e.g. to simulate media keys. Only the first 9 bytes are used.
+  void inject_report(std::span<const std::byte> report) {
+    std::lock_guard lock(mutex);
+    Report copy = {};
+    std::copy_n(report.begin(), std::min(report.size(), copy.size()), copy.begin());
+    queue(clock::now(), copy);
+  }
+
+  std::uint8_t profile() {
+    std::lock_guard lock(mutex);
+    return profile_;
+  }
+  // A copy of the contents of a table
+  std::vector<std::byte> table(X50Q::Table table) {
+    std::lock_guard lock(mutex);
+    auto &data = tables[table_index(table)];
+    return std::vector(data.begin(), data.begin() + X50Q::table_size(table));
+  }
+  // Number of packets received, including invalid ones
+  std::uint64_t packets() {
+    std::lock_guard lock(mutex);
+    return packets_;
+  }
+  std::uint64_t invalid_packets() {
+    std::lock_guard lock(mutex);
+    return invalid_packets_;
+  }
+};
+} // namespace mfk
+#endif
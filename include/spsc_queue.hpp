@@ -0,0 +1,67 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_SPSC_QUEUE_HPP
+#define X50Q_SPSC_QUEUE_HPP
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <optional>
+
+namespace mfk {
+/** Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * N has to be a power of two.
+ */
+template <typename T, std::size_t N> class SpscQueue {
+  static_assert(N && !(N & (N - 1)), "The capacity has to be a power of two");
+  std::array<T, N> slots;
+  // Separate cache lines, otherwise producer and consumer keep stealing them from each other.
+  alignas(64) std::atomic<std::size_t> head = 0; // Next element to pop, written by the consumer
+  alignas(64) std::atomic<std::size_t> tail = 0; // Next element to push, written by the producer
+
+ public:
+  // Returns false if the queue is full.
+  bool push(const T &value) {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) return false;
+    slots[t % N] = value;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+  std::optional<T> pop() {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) return std::nullopt;
+    std::optional<T> value = std::move(slots[h % N]);
+    head.store(h + 1, std::memory_order_release);
+    return value;
+  }
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+};
+} // namespace mfk
+#endif
@@ -0,0 +1,447 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_TIMELINE_HPP
+#define X50Q_TIMELINE_HPP
+#include "x50q.hpp"
+
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace mfk {
+/** Precomputed animations: color frames with timestamps.
+ *
+ * Layout (little endian):
+ *
+ *   Header   "X50QTL" magic, version, number of records, time of the last record
+ *   Records  A RecordHeader followed by size bytes of data, ordered by time
+ *
+ * A Frame record replaces ColorsIdle or ColorsActive. It stores the byte wise difference to the
+ * previous frame of the same table (all zeros before the first one), coded as a sequence of
+ * operations: a varint (n << 2 | op) followed by
+ *
+ *   Skip    nothing, the next n bytes didn't change
+ *   Repeat  one byte, added to the next n bytes. Catches fades and scrolling hues.
+ *   Literal n bytes, added to the next n bytes
+ *   Small   (n + 1) / 2 bytes with two differences between -8 and 7 each, low nibble first.
+ *           Smooth animations mostly consist of these.
+ *
+ * A Table record contains a whole effect or duration table, it gets uploaded unchanged.
+ */
+class Timeline {
+ public:
+  enum class Kind : std::uint8_t { Frame = 1, Table = 2 };
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t records;
+    std::uint32_t duration; // Milliseconds
+    std::uint32_t reserved;
+  };
+  struct RecordHeader {
+    Kind kind;
+    X50Q::Table table;
+    std::uint16_t reserved;
+    std::uint32_t time; // Milliseconds since the start
+    std::uint32_t size;
+  };
+  static_assert(sizeof(Header) == 24 && sizeof(RecordHeader) == 12);
+  static constexpr char magic[8]         = "X50QTL";
+  static constexpr std::uint32_t version = 0x00010000;
+  static constexpr std::size_t frame_size = 3 * 144;
+
+  enum Op : std::uint8_t { Skip = 0, Repeat = 1, Literal = 2, Small = 3 };
+
+  struct Record {
+    Kind kind;
+    X50Q::Table table;
+    std::chrono::milliseconds time;
+    // Frame: the complete decoded frame, valid until the next frame of the same table
+    std::span<const std::byte> data;
+  };
+
+ private:
+  struct Unmap {
+    std::size_t size;
+    void operator()(void *ptr) const noexcept { munmap(ptr, size); }
+  };
+  std::unique_ptr<void, Unmap> mapping{nullptr, Unmap{0}};
+  std::span<const std::byte> mapped;
+  std::ifstream stream; // Only without mapping
+  std::vector<std::byte> buffer;
+  std::size_t offset = sizeof(Header);
+  std::uint32_t remaining;
+  Header header;
+  std::array<std::array<std::byte, frame_size>, 2> frames = {};
+
+  static std::size_t frame_index(X50Q::Table table) {
+    return table == X50Q::Table::ColorsActive;
+  }
+
+  // Largest valid size of the record's data, checked before a corrupt size gets allocated. Every
+  // operation of a Frame covers n >= 1 bytes with a varint of at most two bytes and at most n
+  // bytes of data, so it never takes more than 2n bytes.
+  static std::size_t max_size(const RecordHeader &record) {
+    return record.kind == Kind::Table ? X50Q::table_size(record.table) : 2 * frame_size;
+  }
+
+  static std::size_t get_varint(std::span<const std::byte> data, std::size_t &pos) {
+    std::size_t value = 0;
+    for (int shift = 0; pos != data.size() && shift < 32; shift += 7) {
+      auto byte = std::uint8_t(data[pos++]);
+      value |= std::size_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return value;
+    }
+    throw std::runtime_error("Corrupt timeline");
+  }
+
+  static void decode(std::span<const std::byte> data, std::span<std::byte, frame_size> frame) {
+    std::size_t pos = 0, out = 0;
+    while (pos != data.size()) {
+      auto code = get_varint(data, pos);
+      auto n    = code >> 2;
+      if (!n || n > frame_size - out) throw std::runtime_error("Corrupt timeline");
+      switch (code & 3) {
+      case Skip: break;
+      case Repeat: {
+        if (pos == data.size()) throw std::runtime_error("Corrupt timeline");
+        auto delta = std::uint8_t(data[pos++]);
+        for (std::size_t i = out; i != out + n; ++i)
+          frame[i] = std::byte(std::uint8_t(frame[i]) + delta);
+      } break;
+      case Literal:
+        if (n > data.size() - pos) throw std::runtime_error("Corrupt timeline");
+        for (std::size_t i = 0; i != n; ++i)
+          frame[out + i] = std::byte(std::uint8_t(frame[out + i]) + std::uint8_t(data[pos + i]));
+        pos += n;
+        break;
+      case Small:
+        if ((n + 1) / 2 > data.size() - pos) throw std::runtime_error("Corrupt timeline");
+        for (std::size_t i = 0; i != n; ++i) {
+          // Sign extend the nibble
+          auto nibble    = std::uint8_t(data[pos + i / 2]) >> (i % 2 * 4) & 15;
+          frame[out + i] = std::byte(std::uint8_t(frame[out + i]) + ((nibble ^ 8) - 8));
+        }
+        pos += (n + 1) / 2;
+        break;
+      }
+      out += n;
+    }
+  }
+
+ public:
+  /** Open a timeline.
+   *
+   * With map, the whole file gets mapped into memory. Otherwise it is read record by record,
+   * which keeps the memory usage constant for arbitrarily long animations.
+   */
+  explicit Timeline(const char *path, bool map = true) {
+    if (map) {
+      int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+      struct stat info;
+      if (fstat(fd, &info)) {
+        auto error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), path);
+      }
+      std::size_t size = info.st_size;
+      void *ptr  = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+      auto error = errno;
+      ::close(fd);
+      if (ptr == MAP_FAILED) {
+        if (!size) throw std::runtime_error(fmt::format("{}: Empty file", path));
+        throw std::system_error(error, std::generic_category(), path);
+      }
+      mapping = {ptr, Unmap{size}};
+      mapped  = {static_cast<const std::byte *>(ptr), size};
+      madvise(ptr, size, MADV_SEQUENTIAL);
+      if (size < sizeof header) throw std::runtime_error("Not a timeline");
+      std::memcpy(&header, mapped.data(), sizeof header);
+    } else {
+      stream.open(path, std::ios::binary);
+      if (!stream) throw std::system_error(errno, std::generic_category(), path);
+      if (!stream.read(reinterpret_cast<char *>(&header), sizeof header))
+        throw std::runtime_error("Not a timeline");
+    }
+    if (std::memcmp(header.magic, magic, sizeof magic)) throw std::runtime_error("Not a timeline");
+    if ((header.version & 0xFFFF0000U) != (version & 0xFFFF0000U))
+      throw std::runtime_error("Unsupported timeline version");
+    remaining = header.records;
+  }
+
+  std::size_t records() const { return header.records; }
+  std::chrono::milliseconds duration() const { return std::chrono::milliseconds(header.duration); }
+
+  // The next record, or nullopt after the last one.
+  std::optional<Record> next() {
+    if (!remaining) return std::nullopt;
+    RecordHeader record;
+    std::span<const std::byte> data;
+    if (mapping) {
+      if (mapped.size() - offset < sizeof record) throw std::runtime_error("Truncated timeline");
+      std::memcpy(&record, mapped.data() + offset, sizeof record);
+      offset += sizeof record;
+      if (record.size > max_size(record)) throw std::runtime_error("Corrupt timeline");
+      if (mapped.size() - offset < record.size) throw std::runtime_error("Truncated timeline");
+      data = mapped.subspan(offset, record.size);
+      offset += record.size;
+    } else {
+      if (!stream.read(reinterpret_cast<char *>(&record), sizeof record))
+        throw std::runtime_error("Truncated timeline");
+      if (record.size > max_size(record)) throw std::runtime_error("Corrupt timeline");
+      buffer.resize(record.size);
+      if (!stream.read(reinterpret_cast<char *>(buffer.data()), record.size))
+        throw std::runtime_error("Truncated timeline");
+      data = buffer;
+    }
+    --remaining;
+
+    switch (record.kind) {
+    case Kind::Frame: {
+      if (record.table != X50Q::Table::ColorsIdle && record.table != X50Q::Table::ColorsActive)
+        throw std::runtime_error("Corrupt timeline");
+      auto &frame = frames[frame_index(record.table)];
+      decode(data, frame);
+      data = frame;
+    } break;
+    case Kind::Table:
+      if (data.size() != X50Q::table_size(record.table))
+        throw std::runtime_error("Corrupt timeline");
+      break;
+    default: throw std::runtime_error("Corrupt timeline");
+    }
+    return Record{record.kind, record.table, std::chrono::milliseconds(record.time), data};
+  }
+
+  // Start again with the first record.
+  void rewind() {
+    offset    = sizeof header;
+    remaining = header.records;
+    frames    = {};
+    if (!mapping) {
+      stream.clear();
+      stream.seekg(sizeof header);
+    }
+  }
+};
+
+/** Writes a Timeline.
+ *
+ * The file only appears under its name once finish() succeeded.
+ */
+class TimelineWriter {
+  std::string path;
+  std::ofstream file;
+  Timeline::Header header = {};
+  std::array<std::array<std::uint8_t, Timeline::frame_size>, 2> previous = {};
+  std::vector<std::byte> encoded;
+
+  void put_varint(std::size_t value) {
+    for (; value >= 0x80; value >>= 7)
+      encoded.push_back(std::byte(value | 0x80));
+    encoded.push_back(std::byte(value));
+  }
+  void put_op(Timeline::Op op, std::size_t n) { put_varint(n << 2 | op); }
+
+  static std::size_t op_size(std::size_t n) { return n < 32 ? 1 : 2; }
+
+  // Chooses the shortest sequence of operations (dynamic programming from the end), which is
+  // fast enough for a frame of 432 bytes.
+  void encode(std::span<const std::uint8_t, Timeline::frame_size> from,
+              std::span<const std::uint8_t, Timeline::frame_size> to) {
+    constexpr auto size = Timeline::frame_size;
+    std::array<std::uint8_t, size> delta;
+    for (std::size_t i = 0; i != size; ++i)
+      delta[i] = to[i] - from[i];
+    // Length of the run of equal differences starting at every position
+    std::array<std::size_t, size> run;
+    for (std::size_t i = size; i--;)
+      run[i] = i + 1 != size && delta[i] == delta[i + 1] ? run[i + 1] + 1 : 1;
+
+    struct Choice {
+      std::size_t cost = 0, length = 0;
+      Timeline::Op op  = Timeline::Skip;
+    };
+    std::array<Choice, size + 1> best;
+    for (std::size_t i = size; i--;) {
+      auto &choice = best[i];
+      // A skip at the end is implied
+      if (!delta[i] && i + run[i] == size) {
+        choice = {0, run[i], Timeline::Skip};
+        continue;
+      }
+      auto consider = [&](Timeline::Op op, std::size_t length, std::size_t cost) {
+        cost += best[i + length].cost;
+        if (!choice.length || cost < choice.cost) choice = {cost, length, op};
+      };
+      if (!delta[i])
+        consider(Timeline::Skip, run[i], op_size(run[i]));
+      else
+        consider(Timeline::Repeat, run[i], op_size(run[i]) + 1);
+      for (std::size_t n = 1; i + n <= size; ++n)
+        consider(Timeline::Literal, n, op_size(n) + n);
+      for (std::size_t n = 1; i + n <= size && std::uint8_t(delta[i + n - 1] + 8) < 16; ++n)
+        consider(Timeline::Small, n, op_size(n) + (n + 1) / 2);
+    }
+
+    encoded.clear();
+    for (std::size_t i = 0; i != size && best[i].cost; i += best[i].length) {
+      auto n = best[i].length;
+      put_op(best[i].op, n);
+      switch (best[i].op) {
+      case Timeline::Skip: break;
+      case Timeline::Repeat: encoded.push_back(std::byte(delta[i])); break;
+      case Timeline::Literal:
+        for (auto j = i; j != i + n; ++j)
+          encoded.push_back(std::byte(delta[j]));
+        break;
+      case Timeline::Small:
+        for (auto j = i; j < i + n; j += 2)
+          encoded.push_back(
+              std::byte((delta[j] & 15) | (j + 1 < i + n ? delta[j + 1] << 4 : 0)));
+        break;
+      }
+    }
+  }
+
+  void write(Timeline::Kind kind, X50Q::Table table, std::chrono::milliseconds time,
+             std::span<const std::byte> data) {
+    if (time.count() < header.duration || time.count() > UINT32_MAX)
+      throw std::invalid_argument("Timeline records have to be ordered by time");
+    Timeline::RecordHeader record{kind, table, 0, std::uint32_t(time.count()),
+                                  std::uint32_t(data.size())};
+    file.write(reinterpret_cast<const char *>(&record), sizeof record);
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+    ++header.records;
+    header.duration = time.count();
+  }
+
+ public:
+  explicit TimelineWriter(std::string path):
+      path(std::move(path)), file(this->path + ".tmp", std::ios::binary | std::ios::trunc) {
+    if (!file) throw std::system_error(errno, std::generic_category(), this->path + ".tmp");
+    std::memcpy(header.magic, Timeline::magic, sizeof Timeline::magic);
+    header.version = Timeline::version;
+    file.write(reinterpret_cast<const char *>(&header), sizeof header);
+  }
+
+  TimelineWriter(const TimelineWriter &) = delete;
+  TimelineWriter &operator=(const TimelineWriter &) = delete;
+  // Without finish(), nothing is left behind.
+  ~TimelineWriter() {
+    if (!file.is_open()) return;
+    file.close();
+    std::remove((path + ".tmp").c_str());
+  }
+
+  // Show colors (ColorsIdle or ColorsActive) at time
+  void frame(std::chrono::milliseconds time, X50Q::Table table,
+             const std::uint8_t (&colors)[3][144]) {
+    assert(table == X50Q::Table::ColorsIdle || table == X50Q::Table::ColorsActive);
+    auto &last = previous[table == X50Q::Table::ColorsActive];
+    std::span<const std::uint8_t, Timeline::frame_size> current(&colors[0][0],
+                                                               Timeline::frame_size);
+    encode(last, current);
+    std::ranges::copy(current, last.begin());
+    write(Timeline::Kind::Frame, table, time, encoded);
+  }
+
+  // Upload a whole effect or duration table at time
+  void table(std::chrono::milliseconds time, X50Q::Table table, std::span<const std::byte> data) {
+    if (data.size() != X50Q::table_size(table))
+      throw std::invalid_argument("Timeline tables have to be complete");
+    write(Timeline::Kind::Table, table, time, data);
+  }
+
+  void finish() {
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof header);
+    if (!file.flush()) throw std::runtime_error(fmt::format("Unable to write {}.tmp", path));
+    file.close();
+    if (std::rename((path + ".tmp").c_str(), path.c_str()))
+      throw std::system_error(errno, std::generic_category(), path);
+  }
+};
+
+/** Play a timeline in real time, starting at start.
+ *
+ * Every frame gets uploaded once it is due. If the keyboard falls behind, frames which are
+ * already superseded by a later one are skipped instead of delaying everything after them.
+ * Returns the number of uploaded frames.
+ */
+inline std::size_t play(X50Q &dev, Timeline &timeline,
+                        std::chrono::steady_clock::time_point start =
+                            std::chrono::steady_clock::now()) {
+  std::size_t uploaded = 0;
+  std::span<const std::byte> idle, active;
+  // Upload the newest frames which are still waiting
+  auto flush = [&] {
+    auto colors = [](std::span<const std::byte> frame) {
+      return std::span(reinterpret_cast<const std::uint8_t(*)[144]>(frame.data()), 3);
+    };
+    if (!idle.empty()) dev.apply_colors_idle(colors(idle));
+    if (!active.empty()) dev.apply_colors_active(colors(active));
+    uploaded += !idle.empty() + !active.empty();
+    idle = active = {};
+  };
+  auto record = timeline.next();
+  while (record) {
+    std::this_thread::sleep_until(start + record->time);
+    // Everything due by now. Only the last frame of each table is needed, but tables keep their
+    // place relative to the frames.
+    do {
+      if (record->kind == Timeline::Kind::Table) {
+        flush();
+        dev.apply_blocks(record->table, record->data);
+      } else {
+        (record->table == X50Q::Table::ColorsIdle ? idle : active) = record->data;
+      }
+      record = timeline.next();
+    } while (record && start + record->time <= std::chrono::steady_clock::now());
+    flush();
+  }
+  return uploaded;
+}
+} // namespace mfk
+#endif
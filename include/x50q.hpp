@@ -26,17 +26,42 @@
 #ifndef X50Q_HPP
 #define X50Q_HPP
 #include "hidapi.hpp"
+#include "inplace_function.hpp"
 #include "libusb.hpp"
+#include "spsc_queue.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <bitset>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
 #include <exception>
+#include <fcntl.h>
+#include <filesystem>
 #include <fmt/format.h>
+#include <fstream>
 #include <optional>
+#include <poll.h>
+#include <semaphore>
 #include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <thread>
+#include <unistd.h>
+#include <variant>
 #include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <sys/stat.h>
 #include <vector>
 
 namespace mfk {
@@ -47,28 +72,46 @@ using namespace hidapi;
 // and you should report them.
 class ProtocolException : public std::exception {
   std::uint16_t code_;
-  std::string message;
-  std::vector<std::byte> data;
+  // A fixed buffer instead of a std::string, such that failing doesn't allocate. The context is
+  // never longer than a packet.
+  char message[512];
 
  public:
   ProtocolException(std::uint16_t code, std::span<const std::byte> context): code_(code) {
-    std::ranges::copy(context, std::back_inserter(data));
-    message = fmt::format("Error while communicating with the keyboard. Please create an issue at "
-                          "https://github.com/zauguin/libx50q/issues describing what you did when "
-                          "you got this message and including the following information: \n\n"
-                          "Error code: {}\nContext: ",
-                          code);
-    for (auto b : data)
-      message += fmt::format("{:02x}", std::uint8_t(b));
-  }
-  auto code() { return code_; }
-  const char *what() const noexcept override { return message.c_str(); }
+    constexpr auto size = sizeof message - 1;
+    auto out =
+        fmt::format_to_n(message, size,
+                         "Error while communicating with the keyboard. Please create an issue at "
+                         "https://github.com/zauguin/libx50q/issues describing what you did when "
+                         "you got this message and including the following information: \n\n"
+                         "Error code: {}\nContext: ",
+                         code)
+            .out;
+    for (auto b : context)
+      out = fmt::format_to_n(out, message + size - out, "{:02x}", std::uint8_t(b)).out;
+    *out = '\0';
+  }
+  auto code() const { return code_; }
+  const char *what() const noexcept override { return message; }
   void complain() {
     fmt::print("FATAL ERROR: {}\n\n", message);
     std::terminate();
   }
 };
 
+// Thrown when a command did not finish before its deadline. In contrast to ProtocolException
+// this is not a bug, the keyboard might just be busy or gone.
+class TimeoutError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+// Where state which should not survive a reboot is kept: $XDG_RUNTIME_DIR/x50q or /run/x50q
+inline std::string runtime_directory() {
+  auto runtime = std::getenv("XDG_RUNTIME_DIR");
+  return runtime && *runtime ? std::string(runtime) + "/x50q" : "/run/x50q";
+}
+
 // For durations, we need a 8 bit seconds type:
 using ByteSeconds = std::chrono::duration<std::uint8_t>;
 // We need this to have "the obvious" binary representation.
@@ -76,6 +119,198 @@ using ByteSeconds = std::chrono::duration<std::uint8_t>;
 // If the library does something crazy, we can probably catch that with a simple check:
 static_assert(1 == sizeof(ByteSeconds), "Your standard library implementation is not supported");
 
+/** The connection to the keyboard.
+ *
+ * Commands are sent as 64 byte packets to the output interrupt endpoint and everything the
+ * keyboard sends arrives as HID reports. read() might get called from a different thread than
+ * the other functions, but never concurrently with itself.
+ */
+class Transport {
+ public:
+  virtual ~Transport() = default;
+  // Start sending a packet. Sending fails if it takes longer than timeout. The packet isn't
+  // copied, it has to stay unchanged until it got acknowledged or cancel() returned.
+  virtual void send(std::span<const std::byte, 64> packet, std::chrono::milliseconds timeout) = 0;
+  // Check the packets which finished sending since the last call. Throws if any of them failed.
+  virtual void reap() = 0;
+  // Abort sending all packets which are still in flight and forget about failed ones. Returns
+  // once no packet is in flight anymore.
+  virtual void cancel() = 0;
+  // Read a single report. Waits at most timeout and returns an empty span if nothing arrived.
+  virtual std::span<std::byte> read(std::span<std::byte> buffer,
+                                    std::chrono::milliseconds timeout) = 0;
+  // A file descriptor which becomes readable once read() has a report, for event loops. -1 if
+  // there is none, then read() has to be polled.
+  virtual int fd() const { return -1; }
+};
+
+// The hidraw node of the keyboard, read directly. That's what hidapi does on Linux anyway, but
+// hid_device doesn't expose the file descriptor.
+class HidrawInput {
+  int fd_;
+
+ public:
+  explicit HidrawInput(const char *path): fd_(::open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) {
+    if (fd_ < 0) throw std::system_error(errno, std::generic_category(), path);
+  }
+  HidrawInput(HidrawInput &&other) noexcept: fd_(std::exchange(other.fd_, -1)) {}
+  HidrawInput &operator=(HidrawInput &&other) noexcept {
+    std::swap(fd_, other.fd_);
+    return *this;
+  }
+  ~HidrawInput() {
+    if (fd_ >= 0) ::close(fd_);
+  }
+  int fd() const noexcept { return fd_; }
+  // Same as hidapi::HidDevice::read
+  std::span<std::byte> read(std::span<std::byte> buffer, std::chrono::milliseconds timeout) {
+    pollfd readable{fd_, POLLIN, 0};
+    int ready = ::poll(&readable, 1, int(timeout.count()));
+    if (ready < 0 && errno != EINTR) throw std::system_error(errno, std::generic_category());
+    if (ready <= 0) return {};
+    auto length = ::read(fd_, buffer.data(), buffer.size());
+    if (length >= 0) return buffer.first(length);
+    if (errno == EAGAIN || errno == EINTR) return {};
+    throw std::system_error(errno, std::generic_category());
+  }
+};
+
+// The real keyboard: libusb for the output endpoint, hidapi (or hidraw) for reading.
+class UsbTransport final : public Transport {
+ public:
+  using Reports = std::variant<hidapi::HidDevice, HidrawInput>;
+
+ private:
+  using Packet = std::array<std::byte, 64>;
+
+  // One asynchronous output transfer, sent straight from the packet of the caller.
+  //
+  // The completion callback runs on whichever thread handles libusb events, with several
+  // keyboards (see KeyboardManager) that can be the thread of another keyboard. So the callback
+  // publishes status and actual_length by clearing busy with release semantics, and they are
+  // only read after busy was seen cleared with acquire semantics.
+  struct OutSlot {
+    libusb::Transfer transfer;
+    const std::byte *packet                    = nullptr;
+    std::atomic<bool> busy                     = false;
+    std::atomic<libusb_transfer_status> status = LIBUSB_TRANSFER_COMPLETED;
+    std::atomic<int> actual_length             = std::tuple_size_v<Packet>;
+
+    bool idle() const { return !busy.load(std::memory_order_acquire); }
+    // Only meaningful once idle() returned true
+    bool failed() const {
+      return status.load(std::memory_order_relaxed) != LIBUSB_TRANSFER_COMPLETED ||
+             actual_length.load(std::memory_order_relaxed) != std::tuple_size_v<Packet>;
+    }
+  };
+
+  libusb::Device::Handle output;
+  std::uint8_t endpoint;
+  Reports input;
+  // A deque since the transfers keep pointers to their slots. New slots are added on demand, so
+  // there are as many slots as packets were ever in flight at the same time.
+  std::deque<OutSlot> out_slots;
+
+  void wait_for_transfers() {
+    while (!std::ranges::all_of(out_slots, &OutSlot::idle))
+      libusb::Context::get().handle_events(std::chrono::milliseconds(10));
+  }
+
+ public:
+  // Find the output interrup endpoint id for configuration 0, interface 2, endpoint 0
+  static std::uint16_t find_endpoint(const libusb::Device &dev) {
+    auto config = dev.active_config_descriptor();
+    assert(config->bNumInterfaces == 3);
+    auto out_iface = config->interface[2];
+    assert(out_iface.num_altsetting == 1);
+    auto alternate = out_iface.altsetting[0];
+    assert(alternate.bNumEndpoints == 1);
+    auto endpoint = alternate.endpoint[0];
+    assert(endpoint.bmAttributes == LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT);
+    assert((endpoint.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT);
+    assert(endpoint.wMaxPacketSize == 64);
+    return endpoint.bEndpointAddress;
+  }
+
+  UsbTransport(Reports input, libusb::Device output):
+      output(output.open()), endpoint(find_endpoint(output)), input(std::move(input)) {}
+  // For an already open device whose endpoint is known, e.g. from an earlier find_endpoint.
+  UsbTransport(Reports input, libusb::Device::Handle output, std::uint8_t endpoint):
+      output(std::move(output)), endpoint(endpoint), input(std::move(input)) {}
+  // The transfers reference our buffers, so they have to be finished before we go away.
+  ~UsbTransport() override { cancel(); }
+
+  void send(std::span<const std::byte, 64> packet, std::chrono::milliseconds timeout) override {
+    // Failed slots are kept until cancel() such that the error doesn't get lost.
+    auto slot = std::ranges::find_if(out_slots, [](auto &s) { return s.idle() && !s.failed(); });
+    if (slot == out_slots.end()) {
+      out_slots.emplace_back();
+      slot = std::prev(out_slots.end());
+    }
+    slot->packet = packet.data();
+    slot->transfer.fill_interrupt(
+        output, endpoint, packet,
+        [](libusb_transfer *transfer) {
+          auto &slot = *static_cast<OutSlot *>(transfer->user_data);
+          slot.status.store(transfer->status, std::memory_order_relaxed);
+          slot.actual_length.store(transfer->actual_length, std::memory_order_relaxed);
+          slot.busy.store(false, std::memory_order_release);
+        },
+        &*slot, std::max(timeout, std::chrono::milliseconds(1)));
+    // Before submitting, another thread might already run the callback while we return.
+    slot->busy.store(true, std::memory_order_relaxed);
+    try {
+      slot->transfer.submit();
+    } catch (...) {
+      slot->busy.store(false, std::memory_order_relaxed);
+      throw;
+    }
+  }
+
+  void reap() override {
+    libusb::Context::get().handle_events();
+    for (auto &slot : out_slots) {
+      if (!slot.idle()) continue;
+      auto status = slot.status.load(std::memory_order_relaxed);
+      if (status == LIBUSB_TRANSFER_COMPLETED) continue;
+      throw std::system_error(status == LIBUSB_TRANSFER_NO_DEVICE ? LIBUSB_ERROR_NO_DEVICE
+                                                                  : LIBUSB_ERROR_IO,
+                              libusb::libusb_error_category);
+    }
+    for (auto &slot : out_slots) {
+      if (!slot.idle() || !slot.failed()) continue;
+      throw ProtocolException(0, std::span(slot.packet, std::tuple_size_v<Packet>)
+                                     .subspan(slot.actual_length.load(std::memory_order_relaxed)));
+    }
+  }
+
+  void cancel() override {
+    for (auto &slot : out_slots)
+      if (!slot.idle()) slot.transfer.cancel();
+    wait_for_transfers();
+    for (auto &slot : out_slots) {
+      slot.status.store(LIBUSB_TRANSFER_COMPLETED, std::memory_order_relaxed);
+      slot.actual_length.store(std::tuple_size_v<Packet>, std::memory_order_relaxed);
+    }
+  }
+
+  std::span<std::byte> read(std::span<std::byte> buffer,
+                            std::chrono::milliseconds timeout) override {
+    return std::visit([&](auto &input) { return input.read(buffer, timeout); }, input);
+  }
+
+  int fd() const override {
+    auto hidraw = std::get_if<HidrawInput>(&input);
+    return hidraw ? hidraw->fd() : -1;
+  }
+
+  // hidraw nodes are read directly, everything else through hidapi.
+  static Reports open_reports(const std::string &path) {
+    if (path.starts_with("/dev/hidraw")) return HidrawInput(path.c_str());
+    return hidapi::HidApi::get().open(path.c_str());
+  }
+};
+
 class X50Q {
  public:
   enum class Effect : std::uint8_t {
@@ -96,28 +331,192 @@ class X50Q {
     std::uint8_t unknown_3;
   };
 
+  // The tables which can be uploaded. The values are the command bytes.
+  enum class Table : std::uint8_t {
+    ColorsIdle     = 0x09,
+    ColorsActive   = 0x0a,
+    EffectsIdle    = 0x0d,
+    EffectsActive  = 0x0e,
+    ActiveDuration = 0x0f
+  };
+  static constexpr std::uint16_t table_size(Table table) {
+    return table == Table::ColorsIdle || table == Table::ColorsActive ? 3 * 144 : 144;
+  }
+  // Selects blocks of 60 bytes of a table. No table has more than 8 blocks.
+  using BlockMask = std::bitset<8>;
+
+  using Response = std::array<std::byte, 7>;
+  // Called from poll() once a queued command has been acknowledged or has failed. Stored inline,
+  // so captures are limited to 64 bytes.
+  using Completion       = InplaceFunction<void(std::exception_ptr, const Response &)>;
+  using StatusCompletion = InplaceFunction<void(std::exception_ptr, Status), 48>;
+  // Notifications, see on_profile_change, on_volume_key and on_reconnect. Also stored inline.
+  using ProfileCallback   = InplaceFunction<void(std::uint8_t)>;
+  using VolumeCallback    = InplaceFunction<void(bool)>;
+  using ReconnectCallback = InplaceFunction<void()>;
+
+  // Snapshot of the counters kept by every X50Q, see statistics().
+  struct Statistics {
+    // Bucket 0 counts round trips below 1us, bucket i > 0 those in [2^(i-1), 2^i) us. The last
+    // bucket also counts everything slower.
+    static constexpr std::size_t buckets = 24;
+    struct Command {
+      std::uint64_t transactions = 0; // Completed commands
+      std::uint64_t blocks       = 0; // Acknowledged blocks
+      std::uint64_t failures     = 0; // Failed commands
+      std::array<std::uint64_t, buckets> block_latency = {}; // From sending until acknowledged
+
+      // Upper bound of the bucket containing the given quantile of block_latency
+      std::chrono::microseconds percentile(double p) const {
+        auto rank = std::uint64_t(p * blocks);
+        for (std::size_t i = 0; i != buckets; ++i) {
+          if (block_latency[i] > rank) return std::chrono::microseconds(std::uint64_t(1) << i);
+          rank -= block_latency[i];
+        }
+        return std::chrono::microseconds(std::uint64_t(1) << buckets);
+      }
+    };
+    // The commands 0x01, 0x09, 0x0a, 0x0d, 0x0e, 0x0f, 0x81 and everything else
+    static constexpr std::array<std::uint8_t, 7> command_bytes = {0x01, 0x09, 0x0a, 0x0d,
+                                                                  0x0e, 0x0f, 0x81};
+    std::array<Command, command_bytes.size() + 1> commands;
+    std::uint64_t skipped_reports   = 0; // Reports not meant for us, e.g. media keys
+    std::uint64_t zero_length_reads = 0; // Reads which timed out
+    std::uint64_t reconnects        = 0; // See reconnect()
+    std::array<std::uint64_t, 16> protocol_errors = {}; // By ProtocolException::code()
+
+    static constexpr std::size_t command_index(std::byte cmd) {
+      return std::ranges::find(command_bytes, std::uint8_t(cmd)) - command_bytes.begin();
+    }
+    const Command &command(std::byte cmd) const { return commands[command_index(cmd)]; }
+  };
+
  private:
-  libusb::Device::Handle output;
-  std::uint8_t endpoint;
-  hidapi::HidDevice input;
-  std::function<void(std::uint8_t)> profile_change_callback /*= [](std::uint8_t profile) {
-    fmt::print("Changed profile to {}.\n", profile);
-  }*/;
-  std::function<void(bool)> volume_key_callback;
-
-  std::array<std::byte, 7> generic_exchange(std::span<const std::byte, 64> buffer) {
-    auto remaining = output.send_interrupt(endpoint, buffer);
-    if (!remaining.empty())
-      throw ProtocolException(0, remaining);
-    while (true) {
-      // We allocate 10 bytes even though we only expect 9 bytes. This allows us to detect if too
-      // much data was provided.
-      std::array<std::byte, 10> response;
-      auto length = input.read(response).size();
-      if (length == 0) continue;
-      if (response[0] != std::byte(8))
-        continue; // This happens e.g. when multimedia keys are pressed or the volume is changed
-      if (length != 9) throw ProtocolException(1, response);
+  using Packet = std::array<std::byte, 64>;
+  static constexpr std::size_t max_blocks = BlockMask().size();
+
+  // A command consisting of one or more blocks. Every block gets acknowledged separately with the
+  // same command byte. The acknowledgements do not contain the block index, so they are matched
+  // to the blocks by command and order. Transactions never move: their packets are built in
+  // place and sent from there (or from a Framebuffer), and finished ones get reused.
+  struct Transaction {
+    std::byte cmd;
+    bool with_payload; // The acknowledgement carries data instead of zeros
+    std::size_t blocks                              = 0;
+    std::array<const Packet *, max_blocks> packets = {}; // In own_packets or a Framebuffer
+    std::array<Packet, max_blocks> own_packets     = {};
+    Completion done                                 = {};
+    // How long the command may take. Zero means the default timeout.
+    std::chrono::milliseconds budget                = {};
+    std::chrono::steady_clock::time_point deadline = {};
+    std::size_t sent  = 0;
+    std::size_t acked = 0;
+    // Of every sent block, for the latency histograms
+    std::array<std::chrono::steady_clock::time_point, max_blocks> send_times = {};
+
+    void reset(std::byte cmd, bool with_payload) {
+      this->cmd          = cmd;
+      this->with_payload = with_payload;
+      blocks             = 0;
+      done               = {};
+      budget             = {};
+      sent               = 0;
+      acked              = 0;
+    }
+    // Build the next block in place
+    Packet &add() {
+      assert(blocks < max_blocks);
+      packets[blocks] = &own_packets[blocks];
+      return own_packets[blocks++];
+    }
+    // Send a packet stored elsewhere. It has to stay alive until the transaction finished.
+    void add(const Packet &packet) {
+      assert(blocks < max_blocks);
+      packets[blocks++] = &packet;
+    }
+  };
+  using TransactionRef = std::list<Transaction>::iterator;
+
+  // Backing storage for Statistics. Shared with the event thread, so everything is atomic, but
+  // only relaxed operations are used: The values are only informative.
+  struct Counters {
+    using Counter = std::atomic<std::uint64_t>;
+    struct Command {
+      Counter transactions = 0, blocks = 0, failures = 0;
+      std::array<Counter, Statistics::buckets> block_latency = {};
+    };
+    std::array<Command, std::tuple_size_v<decltype(Statistics::commands)>> commands;
+    Counter skipped_reports = 0, zero_length_reads = 0, reconnects = 0;
+    std::array<Counter, std::tuple_size_v<decltype(Statistics::protocol_errors)>> protocol_errors =
+        {};
+
+    static void bump(Counter &counter) { counter.fetch_add(1, std::memory_order_relaxed); }
+    void count_error(std::exception_ptr error) {
+      try {
+        std::rethrow_exception(error);
+      } catch (const ProtocolException &ex) {
+        if (ex.code() < protocol_errors.size()) bump(protocol_errors[ex.code()]);
+      } catch (...) {}
+    }
+    void count_block(std::byte cmd, std::chrono::steady_clock::duration latency) {
+      auto &command = commands[Statistics::command_index(cmd)];
+      bump(command.blocks);
+      auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+      bump(command.block_latency[std::min<std::size_t>(std::bit_width(std::uint64_t(us)),
+                                                       Statistics::buckets - 1)]);
+    }
+    Statistics snapshot() const {
+      auto load = [](const Counter &counter) { return counter.load(std::memory_order_relaxed); };
+      Statistics result;
+      for (std::size_t i = 0; i != commands.size(); ++i) {
+        result.commands[i].transactions = load(commands[i].transactions);
+        result.commands[i].blocks       = load(commands[i].blocks);
+        result.commands[i].failures     = load(commands[i].failures);
+        std::ranges::transform(commands[i].block_latency,
+                               result.commands[i].block_latency.begin(), load);
+      }
+      result.skipped_reports   = load(skipped_reports);
+      result.zero_length_reads = load(zero_length_reads);
+      result.reconnects        = load(reconnects);
+      std::ranges::transform(protocol_errors, result.protocol_errors.begin(), load);
+      return result;
+    }
+  };
+
+  // Everything reading from the HID interface. It lives on the heap such that the event thread
+  // can keep referencing it while X50Q gets moved.
+  struct Input {
+    Transport &transport;
+    Counters &counters;
+    ProfileCallback profile_change_callback /*= [](std::uint8_t profile) {
+      fmt::print("Changed profile to {}.\n", profile);
+    }*/;
+    VolumeCallback volume_key_callback;
+
+    // Acknowledgements read by the event thread which still have to be matched by poll(). Every
+    // element (and every error) gets announced through available.
+    SpscQueue<Response, 64> acks;
+    std::counting_semaphore<> available{0};
+    std::atomic<bool> has_error = false;
+    std::exception_ptr error;
+    // Has to be the last member such that the thread is stopped before anything else goes away.
+    std::jthread thread;
+
+    Input(Transport &transport, Counters &counters): transport(transport), counters(counters) {}
+
+    // Handles a single report from the HID interface. Returns the response data if it is an
+    // acknowledgement, otherwise dispatches the notification.
+    std::optional<Response> handle_report(std::span<const std::byte> response) {
+      if (response.empty()) {
+        Counters::bump(counters.zero_length_reads);
+        return std::nullopt;
+      }
+      // This happens e.g. when multimedia keys are pressed or the volume is changed
+      if (response[0] != std::byte(8)) {
+        Counters::bump(counters.skipped_reports);
+        return std::nullopt;
+      }
+      if (response.size() != 9) throw ProtocolException(1, response);
       switch (response[1]) {
       case std::byte(2): {
         constexpr std::array<std::uint8_t, 7> notification_structure = {0x03, 0x24, 0xf0, 0x20,
@@ -144,96 +543,752 @@ class X50Q {
           default: throw ProtocolException(3, response);
           }
       } break;
-      case std::byte(0):
-        std::array<std::byte, 7> data;
+      case std::byte(0): {
+        Response data;
         std::copy(response.begin() + 2, response.end(), data.begin());
         return data;
+      }
       default: throw ProtocolException(4, response);
       }
+      return std::nullopt;
+    }
+
+    // Only called by the event thread. If an error is still pending, the new one gets dropped.
+    void report_error(std::exception_ptr e) {
+      if (has_error.load(std::memory_order_acquire)) return;
+      error = std::move(e);
+      has_error.store(true, std::memory_order_release);
+      available.release();
+    }
+    // Only called by the thread calling poll()
+    std::exception_ptr take_error() {
+      if (!has_error.load(std::memory_order_acquire)) return nullptr;
+      auto e = std::exchange(error, nullptr);
+      has_error.store(false, std::memory_order_release);
+      return e;
+    }
+
+    void run(std::stop_token stop) {
+      // We allocate 10 bytes even though we only expect 9 bytes. This allows us to detect if
+      // too much data was provided.
+      std::array<std::byte, 10> buffer;
+      while (!stop.stop_requested()) {
+        try {
+          // The timeout only determines how fast we react to stop requests.
+          auto response = handle_report(transport.read(buffer, std::chrono::milliseconds(100)));
+          if (!response) continue;
+          while (!acks.push(*response)) {
+            if (stop.stop_requested()) return;
+            std::this_thread::yield();
+          }
+          available.release();
+        } catch (const ProtocolException &) {
+          counters.count_error(std::current_exception());
+          report_error(std::current_exception());
+        } catch (...) {
+          // Most likely the device is gone, no reason to continue.
+          report_error(std::current_exception());
+          return;
+        }
+      }
+    }
+  };
+
+  // Queued transactions, those being built by make_transaction and finished ones to be reused.
+  // Transfers might still read the packets until the transport is gone, so they are declared
+  // before it.
+  std::list<Transaction> transactions, staged, spare;
+  // The transport and the counters have to outlive the event thread, so they are declared first.
+  std::unique_ptr<Counters> counters = std::make_unique<Counters>();
+  std::unique_ptr<Transport> transport_;
+  std::unique_ptr<Input> input;
+
+  std::size_t pipeline_depth = 4;
+  std::size_t in_flight = 0; // Blocks which have been submitted but not acknowledged
+  std::chrono::milliseconds timeout = std::chrono::seconds(1);
+  std::optional<std::chrono::steady_clock::time_point> scope_deadline;
+
+  // Where to find the keyboard again after it got lost, only known for keyboards opened through
+  // enumerate(). The hotplug callback runs on whichever thread handles libusb events, so the flags
+  // are atomic.
+  struct Connection {
+    std::uint16_t vid = 0, pid = 0;
+    std::string location;
+    std::uint8_t address = 0; // Changes whenever the keyboard gets reconnected
+    std::atomic<bool> lost      = false; // Unplugged or failed with something else than a timeout
+    std::atomic<bool> unplugged = false; // libusb reported that the keyboard left
+    std::atomic<bool> arrived   = false; // A keyboard showed up at location
+    // Retries if no hotplug event is expected, e.g. after an I/O error on an attached keyboard
+    std::chrono::steady_clock::time_point next_attempt = {};
+    std::optional<libusb::Hotplug> hotplug;
+  };
+  std::unique_ptr<Connection> connection;
+  ReconnectCallback reconnect_callback;
+  static constexpr std::chrono::milliseconds reconnect_interval{250};
+
+  // Check an acknowledgement against the oldest unacknowledged block.
+  static void check_ack(const Transaction &transaction, const Response &response) {
+    if (transaction.with_payload) {
+      if (std::byte(0x8) != response[0]) throw ProtocolException(8, response);
+      if (transaction.cmd != response[1]) throw ProtocolException(9, response);
+    } else {
+      if (std::byte(0x8) != response[0]) throw ProtocolException(5, response);
+      if (transaction.cmd != response[1]) throw ProtocolException(6, response);
+      if (std::ranges::any_of(std::span(response).subspan(2),
+                              [](std::byte b) { return b != std::byte(); }))
+        throw ProtocolException(7, response);
     }
   }
 
-  auto exchange_block(std::byte cmd, std::byte sub_cmd, std::uint8_t index = {},
-                      std::span<const std::byte> payload = {}) {
+  // Wait for one acknowledgement and drop it. Returns false if nothing arrived before the timeout.
+  bool discard_ack(std::chrono::milliseconds wait) {
+    try {
+      if (input->thread.joinable()) {
+        if (!input->available.try_acquire_for(wait)) return false;
+        if (auto error = input->take_error()) std::rethrow_exception(error);
+        return input->acks.pop().has_value();
+      }
+      std::array<std::byte, 10> buffer;
+      auto report = transport_->read(buffer, wait);
+      if (report.empty()) return false;
+      return input->handle_report(report).has_value();
+    } catch (...) {
+      counters->count_error(std::current_exception());
+      return false;
+    }
+  }
+
+  void fail(Transaction &transaction, std::exception_ptr error) {
+    Counters::bump(counters->commands[Statistics::command_index(transaction.cmd)].failures);
+    if (transaction.done) transaction.done(std::move(error), {});
+  }
+
+  // Anything but protocol errors and timeouts might mean that the keyboard is gone.
+  void note_failure(std::exception_ptr error) {
+    if (!connection) return;
+    try {
+      std::rethrow_exception(error);
+    } catch (const ProtocolException &) {
+    } catch (const TimeoutError &) {
+    } catch (...) { connection->lost = true; }
+  }
+
+  // Reopen the keyboard if it is back after getting lost. Called before every command.
+  void check_connection() {
+    if (!connection || !connection->lost) return;
+    // Nobody else might handle libusb events while the keyboard is gone.
+    if (connection->hotplug) libusb::Context::get().handle_events();
+    if (connection->unplugged) {
+      // Only the hotplug callback knows when it is back.
+      if (!connection->arrived) return;
+    } else {
+      auto now = std::chrono::steady_clock::now();
+      if (now < connection->next_attempt) return;
+      connection->next_attempt = now + reconnect_interval;
+    }
+    reconnect();
+  }
+
+  // Fail every queued transaction and bring the connection back into a known state.
+  void abort(std::exception_ptr error) {
+    note_failure(error);
+    transport_->cancel();
+    in_flight = 0;
+    std::list<Transaction> failed;
+    failed.splice(failed.end(), transactions);
+    // Blocks which already reached the keyboard still get acknowledged, possibly very late. We
+    // can't tell these acknowledgements from new ones, so we drop everything until the keyboard
+    // stays quiet for a while. This never takes more than max_resync.
+    constexpr auto quiet      = std::chrono::milliseconds(20);
+    constexpr auto max_resync = std::chrono::milliseconds(200);
+    const auto give_up        = std::chrono::steady_clock::now() + max_resync;
+    for (auto quiet_until = std::chrono::steady_clock::now() + quiet;;) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= quiet_until || now >= give_up) break;
+      if (discard_ack(std::chrono::ceil<std::chrono::milliseconds>(quiet_until - now)))
+        quiet_until = std::chrono::steady_clock::now() + quiet;
+    }
+    for (auto &transaction : failed)
+      fail(transaction, error);
+    spare.splice(spare.end(), failed);
+  }
+
+  // Fail commands which missed their deadline. Commands which didn't start yet are simply
+  // dropped, otherwise the whole connection has to be resynchronized.
+  void expire() {
+    const auto now = std::chrono::steady_clock::now();
+    if (!transactions.empty() && transactions.front().sent &&
+        transactions.front().deadline <= now)
+      throw TimeoutError("The keyboard did not respond in time");
+    std::list<Transaction> expired;
+    for (auto it = transactions.begin(); it != transactions.end();) {
+      auto next = std::next(it);
+      if (!it->sent && it->deadline <= now) expired.splice(expired.end(), transactions, it);
+      it = next;
+    }
+    for (auto &transaction : expired)
+      fail(transaction, std::make_exception_ptr(TimeoutError("Command dropped after deadline")));
+    spare.splice(spare.end(), expired);
+  }
+
+  // Submit blocks until pipeline_depth blocks are in flight.
+  void fill_pipeline() {
+    for (auto &transaction : transactions) {
+      while (transaction.sent != transaction.blocks) {
+        if (in_flight >= pipeline_depth) return;
+        auto now = std::chrono::steady_clock::now();
+        transport_->send(*transaction.packets[transaction.sent],
+                         std::chrono::ceil<std::chrono::milliseconds>(transaction.deadline - now));
+        transaction.send_times[transaction.sent] = now;
+        ++transaction.sent;
+        ++in_flight;
+      }
+    }
+  }
+
+  void acknowledge(const Response &response) {
+    if (!in_flight) {
+      // Most likely a late acknowledgement of a block from before the last resync
+      Counters::bump(counters->protocol_errors[10]);
+      return;
+    }
+    auto &transaction = transactions.front();
+    check_ack(transaction, response);
+    --in_flight;
+    counters->count_block(transaction.cmd, std::chrono::steady_clock::now() -
+                                               transaction.send_times[transaction.acked]);
+    if (++transaction.acked != transaction.blocks) return;
+    Counters::bump(counters->commands[Statistics::command_index(transaction.cmd)].transactions);
+    auto done = std::move(transaction.done);
+    spare.splice(spare.end(), transactions, transactions.begin());
+    if (done) done(nullptr, response);
+  }
+
+  // Handle one element announced by the event thread
+  void take_event() {
+    if (auto error = input->take_error()) std::rethrow_exception(error);
+    if (auto response = input->acks.pop()) acknowledge(*response);
+  }
+
+  static void make_block(Packet &msg, std::byte cmd, std::byte sub_cmd, std::uint8_t index = {},
+                         std::span<const std::byte> payload = {}) {
     assert(payload.size() <= 60);
-    std::array<std::byte, 64> msg = {std::byte(7), cmd, sub_cmd, std::byte(index)};
+    msg = {std::byte(7), cmd, sub_cmd, std::byte(index)};
     std::ranges::copy(payload, msg.begin() + 4);
-    auto response = generic_exchange(msg);
-    if (std::byte(0x8) != response[0]) throw ProtocolException(5, response);
-    if (cmd != response[1]) throw ProtocolException(6, response);
-    if (std::ranges::any_of(std::span(response).subspan(2),
-                            [](std::byte b) { return b != std::byte(); }))
-      throw ProtocolException(7, response);
   }
 
-  auto exchange(std::byte cmd, std::byte sub_cmd, std::uint16_t max_data_size = 0,
-                std::span<const std::byte> payload = {}) {
+  // A transaction to be filled and passed to submit() or run(). Reuses a finished one if possible.
+  TransactionRef stage(std::byte cmd, bool with_payload) {
+    if (spare.empty()) spare.emplace_back();
+    staged.splice(staged.end(), spare, spare.begin());
+    auto transaction = std::prev(staged.end());
+    transaction->reset(cmd, with_payload);
+    return transaction;
+  }
+
+  TransactionRef make_transaction(std::byte cmd, std::byte sub_cmd, std::uint16_t max_data_size,
+                                  std::span<const std::byte> payload,
+                                  BlockMask selected = BlockMask().set()) {
     assert(payload.size() <= max_data_size);
-    assert(max_data_size <= 60 * 256);
-    const int blocks = max_data_size ? (max_data_size + 59) / 60 : 1;
-    for (std::uint8_t i = 0; blocks != i; ++i) {
+    assert(max_data_size <= 60 * max_blocks);
+    const std::size_t blocks = max_data_size ? (max_data_size + 59) / 60 : 1;
+    auto transaction         = stage(cmd, false);
+    for (std::size_t i = 0; blocks != i; ++i) {
       auto this_payload = payload.size() <= 60 ? payload : payload.subspan(0, 60);
       payload           = payload.subspan(this_payload.size());
-      exchange_block(cmd, sub_cmd, i, this_payload);
+      if (i < selected.size() && !selected[i]) continue;
+      make_block(transaction->add(), cmd, sub_cmd, i, this_payload);
     }
+    return transaction;
   }
 
-  void setup();
-  void set_builtin_(std::uint8_t index) { exchange(std::byte(0x01), std::byte(index)); }
+  // Queue a transaction and block until it completed.
+  Response run(TransactionRef transaction) {
+    std::exception_ptr error;
+    Response result;
+    bool finished     = false;
+    transaction->done = [&](std::exception_ptr e, const Response &response) {
+      error    = std::move(e);
+      result   = response;
+      finished = true;
+    };
+    submit(transaction);
+    while (!finished)
+      poll(std::chrono::milliseconds(1));
+    if (error) std::rethrow_exception(error);
+    return result;
+  }
 
-  static X50Q find_device(std::uint16_t vid, std::uint16_t pid) {
-    auto &hid = hidapi::HidApi::get();
-    std::optional<std::string> path;
-    for (auto &&dev : hid.enumerate(vid, pid)) {
-      if (1 == dev.interface_number) {
-        path = dev.path;
-        break;
-      }
+  void exchange(std::byte cmd, std::byte sub_cmd, std::uint16_t max_data_size = 0,
+                std::span<const std::byte> payload = {}) {
+    run(make_transaction(cmd, sub_cmd, max_data_size, payload));
+  }
+
+  void exchange_async(std::byte cmd, std::byte sub_cmd, std::uint16_t max_data_size,
+                      std::span<const std::byte> payload, Completion done) {
+    auto transaction  = make_transaction(cmd, sub_cmd, max_data_size, payload);
+    transaction->done = std::move(done);
+    submit(transaction);
+  }
+
+  std::future<void> exchange_async(std::byte cmd, std::byte sub_cmd, std::uint16_t max_data_size,
+                                   std::span<const std::byte> payload) {
+    auto promise = std::make_shared<std::promise<void>>();
+    auto future  = promise->get_future();
+    exchange_async(cmd, sub_cmd, max_data_size, payload,
+                   [promise](std::exception_ptr error, const Response &) {
+                     if (error)
+                       promise->set_exception(std::move(error));
+                     else
+                       promise->set_value();
+                   });
+    return future;
+  }
+
+  static Status to_status(const Response &response) {
+    Status status;
+    static_assert(sizeof status + 2 == std::tuple_size_v<Response>);
+    memcpy(&status, response.data() + 2, sizeof status);
+    return status;
+  }
+
+  void submit(TransactionRef transaction) {
+    if (!transaction->blocks) {
+      auto done = std::move(transaction->done);
+      spare.splice(spare.end(), staged, transaction);
+      if (done) done(nullptr, {});
+      return;
     }
-    if (!path) throw std::runtime_error("X50Q keyboard not detected");
-    auto in_handle = hid.open(path->c_str());
+    check_connection();
+    auto budget           = std::max(transaction->budget, timeout);
+    transaction->deadline = std::chrono::steady_clock::now() + budget;
+    if (scope_deadline) transaction->deadline = std::min(transaction->deadline, *scope_deadline);
+    transactions.splice(transactions.end(), staged, transaction);
+    try {
+      fill_pipeline();
+    } catch (...) { abort(std::current_exception()); }
+  }
 
-    auto &context = libusb::Context::get();
-    libusb::Device out_handle;
-    for (auto &&dev : context.list()) {
-      auto desc = dev.device_descriptor();
-      if (desc.idVendor == vid && desc.idProduct == pid) { out_handle = std::move(dev); }
+  void set_builtin_(std::uint8_t index) {
+    auto transaction = make_transaction(std::byte(0x01), std::byte(index), 0, {});
+    // Resetting with index 0 takes more than 4 seconds
+    if (!index) transaction->budget = std::chrono::seconds(10);
+    run(transaction);
+  }
+
+  // Location of a USB device as used by sysfs, e.g. "1-2.4" for port 4 of the hub on port 2 of
+  // bus 1.
+  static std::string usb_location(const libusb::Device &dev) {
+    auto location = fmt::format("{}-", dev.bus_number());
+    auto ports    = dev.port_numbers();
+    for (std::size_t i = 0; i != ports.size(); ++i)
+      location += (i ? "." : "") + std::to_string(ports[i]);
+    return location;
+  }
+
+  static bool is_usb_location(std::string_view name) {
+    auto dash = name.find('-');
+    if (dash == 0 || dash == name.npos || dash + 1 == name.size()) return false;
+    return std::ranges::all_of(name.substr(0, dash), [](char c) { return std::isdigit(c); }) &&
+           std::ranges::all_of(name.substr(dash + 1),
+                               [](char c) { return std::isdigit(c) || c == '.'; });
+  }
+
+  // The location of the USB device a HID device belongs to. Depending on the hidapi backend,
+  // this is either in the format of usb_location or "bus:address" as two hex numbers with four
+  // digits each.
+  static std::optional<std::string> hid_location(std::string_view path) {
+    // hidraw: The sysfs entry of the hidraw device is a child of the USB device.
+    if (path.starts_with("/dev/")) {
+      std::error_code ec;
+      auto sysfs = std::filesystem::canonical(
+          std::filesystem::path("/sys/class/hidraw") / path.substr(5) / "device", ec);
+      if (ec) return std::nullopt;
+      for (; sysfs.has_relative_path(); sysfs = sysfs.parent_path())
+        if (auto name = sysfs.filename().string(); is_usb_location(name)) return name;
+      return std::nullopt;
     }
-    if (!out_handle) throw std::runtime_error("Unable to find keyboard with libusb");
+    // libusb backend: Either "bus-ports:config.interface" or "bbbb:aaaa:ii"
+    if (auto colon = path.find(':'); colon != path.npos && is_usb_location(path.substr(0, colon)))
+      return std::string(path.substr(0, colon));
+    if (path.size() == 12 && path[4] == ':' && path[9] == ':')
+      return std::string(path.substr(0, 9));
+    return std::nullopt;
+  }
+
+  // What find_device found last time. Kept in the runtime directory, named after vid and pid.
+  struct CachedDevice {
+    std::uint32_t version = 0x00010000;
+    std::uint16_t vid = 0, pid = 0;
+    std::uint8_t bus = 0, address = 0, endpoint = 0, reserved = 0;
+    char location[36] = {};
+    char hid_path[64] = {};
+  };
 
-    return X50Q(std::move(in_handle), std::move(out_handle));
+  static std::string discovery_cache(std::uint16_t vid, std::uint16_t pid) {
+    return fmt::format("{}/{:04x}:{:04x}", runtime_directory(), vid, pid);
   }
 
-  // Find the output interrup endpoint id for configuration 0, interface 2, endpoint 0
-  static std::uint16_t find_endpoint(const libusb::Device &dev) {
-    auto config = dev.active_config_descriptor();
-    assert(config->bNumInterfaces == 3);
-    auto out_iface = config->interface[2];
-    assert(out_iface.num_altsetting == 1);
-    auto alternate = out_iface.altsetting[0];
-    assert(alternate.bNumEndpoints == 1);
-    auto endpoint = alternate.endpoint[0];
-    assert(endpoint.bmAttributes == LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT);
-    assert((endpoint.bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT);
-    assert(endpoint.wMaxPacketSize == 64);
-    return endpoint.bEndpointAddress;
+  // Only for hidraw, where the cache can be validated through sysfs. Failing is harmless, the
+  // next process just enumerates again.
+  static void remember(std::string_view hid_path, std::string_view location,
+                       const libusb::Device &usb, const std::string &path) try {
+    if (!hid_path.starts_with("/dev/") || location.empty()) return;
+    CachedDevice cached;
+    if (hid_path.size() >= sizeof cached.hid_path || location.size() >= sizeof cached.location)
+      return;
+    auto descriptor = usb.device_descriptor();
+    cached.vid      = descriptor.idVendor;
+    cached.pid      = descriptor.idProduct;
+    cached.bus      = usb.bus_number();
+    cached.address  = usb.address();
+    cached.endpoint = UsbTransport::find_endpoint(usb);
+    std::ranges::copy(location, cached.location);
+    std::ranges::copy(hid_path, cached.hid_path);
+
+    auto dir = runtime_directory();
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) return;
+    auto temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.write(reinterpret_cast<const char *>(&cached), sizeof cached).flush()) return;
+    file.close();
+    std::rename(temporary.c_str(), path.c_str());
+  } catch (...) {}
+
+  /** Open the keyboard described by the cache, if it is still there.
+   *
+   * Checking a few sysfs attributes of the USB port is enough: The address changes whenever
+   * anything gets plugged in there. The usbfs device node gets opened directly, so neither
+   * hidapi nor libusb have to enumerate anything. Returns nullptr if anything doesn't fit.
+   */
+  static std::unique_ptr<Transport> open_cached(const CachedDevice &cached) try {
+    auto sysfs     = fmt::format("/sys/bus/usb/devices/{}/", cached.location);
+    auto attribute = [&](const char *name, std::ios_base &(*base)(std::ios_base &)) {
+      unsigned value = ~0U;
+      std::ifstream(sysfs + name) >> base >> value;
+      return value;
+    };
+    if (attribute("idVendor", std::hex) != cached.vid ||
+        attribute("idProduct", std::hex) != cached.pid ||
+        attribute("busnum", std::dec) != cached.bus ||
+        attribute("devnum", std::dec) != cached.address ||
+        hid_location(cached.hid_path) != cached.location)
+      return nullptr;
+    auto input = UsbTransport::open_reports(cached.hid_path);
+    auto node  = fmt::format("/dev/bus/usb/{:03}/{:03}", cached.bus, cached.address);
+    int fd     = ::open(node.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    return std::make_unique<UsbTransport>(std::move(input), libusb::Context::get().wrap(fd),
+                                          cached.endpoint);
+  } catch (...) { return nullptr; }
+
+  // The first keyboard. Tries the one found last time before enumerating everything.
+  static X50Q find_device(std::uint16_t vid, std::uint16_t pid) {
+    auto cache = discovery_cache(vid, pid);
+    CachedDevice cached;
+    std::ifstream file(cache, std::ios::binary);
+    if (file.read(reinterpret_cast<char *>(&cached), sizeof cached) &&
+        cached.version == CachedDevice().version && cached.vid == vid && cached.pid == pid &&
+        !cached.location[sizeof cached.location - 1] &&
+        !cached.hid_path[sizeof cached.hid_path - 1])
+      if (auto transport = open_cached(cached))
+        return X50Q(std::move(transport), vid, pid, cached.location, cached.address);
+
+    auto devices = enumerate(vid, pid);
+    if (devices.empty()) throw std::runtime_error("X50Q keyboard not detected");
+    remember(devices.front().hid_path, devices.front().location, devices.front().usb, cache);
+    return X50Q(devices.front());
+  }
+
+  // Opened through enumerate() or the discovery cache, so it can be reconnected.
+  X50Q(std::unique_ptr<Transport> transport, std::uint16_t vid, std::uint16_t pid,
+       std::string location, std::uint8_t address):
+      X50Q(std::move(transport)) {
+    connection           = std::make_unique<Connection>();
+    connection->vid      = vid;
+    connection->pid      = pid;
+    connection->location = std::move(location);
+    connection->address  = address;
+    if (!libusb::Context::has_hotplug()) return;
+    connection->hotplug.emplace(libusb::Context::get().on_hotplug(
+        connection->vid, connection->pid,
+        [&connection = *connection](libusb::Hotplug::Event event, const libusb::Device &dev) {
+          try {
+            if (usb_location(dev) != connection.location) return;
+          } catch (...) { return; }
+          if (event == libusb::Hotplug::Event::Arrived) {
+            connection.arrived = true;
+            return;
+          }
+          connection.unplugged = true;
+          connection.lost      = true;
+        }));
   }
 
  public:
-  X50Q(hidapi::HidDevice input, libusb::Device output):
-      output(output.open()), endpoint(find_endpoint(output)), input(std::move(input)) {}
+  // A keyboard found by enumerate()
+  struct DeviceInfo {
+    std::string hid_path;
+    libusb::Device usb;
+    std::string location; // See usb_location()
+  };
+
+  /** Find all connected keyboards.
+   *
+   * Every keyboard shows up twice, once for hidapi and once for libusb. They are paired by their
+   * position on the bus. Where that can't be determined (e.g. on other platforms than Linux),
+   * a single keyboard still gets found.
+   */
+  static std::vector<DeviceInfo> enumerate(std::uint16_t vid = 0x24f0,
+                                           std::uint16_t pid = 0x202b) {
+    std::vector<std::string> paths;
+    for (auto &&dev : hidapi::HidApi::get().enumerate(vid, pid))
+      if (1 == dev.interface_number) paths.push_back(dev.path);
+
+    std::vector<libusb::Device> usb_devices;
+    for (auto &&dev : libusb::Context::get().list()) {
+      auto desc = dev.device_descriptor();
+      if (desc.idVendor == vid && desc.idProduct == pid) usb_devices.push_back(std::move(dev));
+    }
+
+    std::vector<DeviceInfo> devices;
+    for (auto &path : paths) {
+      auto location = hid_location(path);
+      auto usb      = std::ranges::find_if(usb_devices, [&](const libusb::Device &dev) {
+        if (!location) return paths.size() == 1 && usb_devices.size() == 1;
+        return *location == usb_location(dev) ||
+               *location == fmt::format("{:04x}:{:04x}", dev.bus_number(), dev.address());
+      });
+      if (usb == usb_devices.end()) continue;
+      devices.push_back({std::move(path), std::move(*usb), usb_location(*usb)});
+      usb_devices.erase(usb);
+    }
+    return devices;
+  }
+
+  explicit X50Q(const DeviceInfo &device):
+      X50Q(std::make_unique<UsbTransport>(UsbTransport::open_reports(device.hid_path), device.usb),
+           device.usb.device_descriptor().idVendor, device.usb.device_descriptor().idProduct,
+           device.location, device.usb.address()) {}
+  explicit X50Q(std::unique_ptr<Transport> transport):
+      transport_(std::move(transport)), input(std::make_unique<Input>(*transport_, *counters)) {}
+  X50Q(UsbTransport::Reports input, libusb::Device output):
+      X50Q(std::make_unique<UsbTransport>(std::move(input), std::move(output))) {}
   X50Q(std::uint16_t vid = 0x24f0, std::uint16_t pid = 0x202b): X50Q(find_device(vid, pid)) {}
 
+  Transport &transport() { return *transport_; }
+
+  /** Start a thread which reads everything the keyboard sends.
+   *
+   * Without it, notifications are only dispatched while poll() (or any blocking function) runs.
+   * With it, the callbacks are called immediately, but from the event thread. Acknowledgements
+   * are handed to poll() without locking.
+   */
+  void start_event_thread() {
+    if (input->thread.joinable()) return;
+    input->thread = std::jthread([&input = *input](std::stop_token stop) { input.run(stop); });
+  }
+  void stop_event_thread() {
+    if (!input->thread.joinable()) return;
+    input->thread.request_stop();
+    input->thread.join();
+  }
+
+  /** Called with the new profile (1 to 6) whenever it gets changed on the keyboard.
+   *
+   * Can't be changed while the event thread is running.
+   */
+  void on_profile_change(ProfileCallback callback) {
+    assert(!input->thread.joinable());
+    input->profile_change_callback = std::move(callback);
+  }
+  /** Called when the volume knob gets used. Can't be changed while the event thread is running.
+   */
+  void on_volume_key(VolumeCallback callback) {
+    assert(!input->thread.joinable());
+    input->volume_key_callback = std::move(callback);
+  }
+
+  /** Reopen the keyboard after it got unplugged or reset.
+   *
+   * Usually there is no need to call this: Once libusb reports that the keyboard is back, it
+   * gets reopened before the next command (or poll()). Without hotplug support, or if it failed
+   * without being unplugged, this is tried at most every 250ms while the keyboard is gone. Only
+   * works for keyboards opened through enumerate() or find_device(). Queued commands fail.
+   * Returns false if the keyboard can't be opened (yet).
+   */
+  bool reconnect() {
+    if (!connection) return false;
+    std::unique_ptr<Transport> transport;
+    try {
+      auto devices = enumerate(connection->vid, connection->pid);
+      auto device  = std::ranges::find(devices, connection->location, &DeviceInfo::location);
+      if (device == devices.end()) return false;
+      transport = std::make_unique<UsbTransport>(UsbTransport::open_reports(device->hid_path),
+                                                 device->usb);
+      connection->address = device->usb.address();
+    } catch (...) {
+      // E.g. udev didn't finish setting up the permissions yet
+      return false;
+    }
+    const bool event_thread = input->thread.joinable();
+    stop_event_thread();
+    auto profile_change_callback = std::move(input->profile_change_callback);
+    auto volume_key_callback     = std::move(input->volume_key_callback);
+    input.reset();
+    transport_ = std::move(transport);
+    input      = std::make_unique<Input>(*transport_, *counters);
+    input->profile_change_callback = std::move(profile_change_callback);
+    input->volume_key_callback     = std::move(volume_key_callback);
+    if (event_thread) start_event_thread();
+    connection->lost      = false;
+    connection->unplugged = false;
+    connection->arrived   = false;
+    Counters::bump(counters->reconnects);
+
+    in_flight = 0;
+    std::list<Transaction> failed;
+    failed.splice(failed.end(), transactions);
+    auto error = std::make_exception_ptr(
+        std::system_error(LIBUSB_ERROR_NO_DEVICE, libusb::libusb_error_category));
+    for (auto &transaction : failed)
+      fail(transaction, error);
+    spare.splice(spare.end(), failed);
+    if (reconnect_callback) reconnect_callback();
+    return true;
+  }
+
+  // Where the keyboard is connected (see usb_location), empty if it wasn't opened through
+  // enumerate().
+  std::string_view location() const { return connection ? connection->location : ""; }
+  // The USB address changes whenever the keyboard gets plugged in again. Zero if unknown.
+  std::uint8_t usb_address() const { return connection ? connection->address : 0; }
+
+  /** Called after the keyboard got reopened by reconnect().
+   *
+   * The keyboard falls back to its builtin profile when it loses power, so this is the place to
+   * upload everything again, see ShadowState::restore_on_reconnect. Commands can be sent from
+   * the callback.
+   */
+  void on_reconnect(ReconnectCallback callback) { reconnect_callback = std::move(callback); }
+
+  /** Counters and latency histograms of everything sent and received so far.
+   *
+   * Can be called from any thread.
+   */
+  Statistics statistics() const { return counters->snapshot(); }
+
+  /** How long a single command (e.g. one apply_* call) may take before it fails with a
+   * TimeoutError. Defaults to one second.
+   */
+  void set_timeout(std::chrono::milliseconds budget) { timeout = budget; }
+
+  // Restores the previous deadline when it goes out of scope.
+  class [[nodiscard]] DeadlineScope {
+    X50Q *device;
+    std::optional<std::chrono::steady_clock::time_point> previous;
+
+   public:
+    DeadlineScope(X50Q &device, std::chrono::steady_clock::time_point deadline):
+        device(&device), previous(device.scope_deadline) {
+      device.scope_deadline = previous ? std::min(*previous, deadline) : deadline;
+    }
+    DeadlineScope(const DeadlineScope &) = delete;
+    DeadlineScope &operator=(const DeadlineScope &) = delete;
+    ~DeadlineScope() { device->scope_deadline = previous; }
+  };
+
+  /** Let every command queued while the returned object exists fail if it is not finished at
+   * deadline. Useful to give a whole sequence of commands (like Profile::apply) a common budget:
+   *
+   *   auto scope = dev.deadline_scope(std::chrono::steady_clock::now() + 20ms);
+   *
+   * Commands which did not start before the deadline get dropped. If a command times out while
+   * it is being sent, all queued commands fail and the connection is resynchronized.
+   */
+  DeadlineScope deadline_scope(std::chrono::steady_clock::time_point deadline) {
+    return DeadlineScope(*this, deadline);
+  }
+
+  /** Maximal number of blocks sent before the first of them got acknowledged.
+   *
+   * Higher values hide the USB round trip time. Set it to 1 to get the strictly sequential
+   * behavior of the Windows driver.
+   */
+  void set_pipeline_depth(std::size_t depth) {
+    assert(depth > 0);
+    pipeline_depth = depth;
+  }
+
+  /** When poll() has to be called next even if transport().fd() doesn't become readable.
+   *
+   * For event loops: Queued commands fail once they miss their deadline, and a lost keyboard is
+   * looked for periodically. Empty if nothing happens until the keyboard sends a report.
+   */
+  std::optional<std::chrono::steady_clock::time_point> next_deadline() const {
+    std::optional<std::chrono::steady_clock::time_point> next;
+    if (connection && connection->lost)
+      next = connection->unplugged ? std::chrono::steady_clock::now() + reconnect_interval
+                                   : connection->next_attempt;
+    for (auto &transaction : transactions)
+      next = std::min(next.value_or(transaction.deadline), transaction.deadline);
+    return next;
+  }
+
+  /** Drive queued commands and dispatch notifications.
+   *
+   * Waits at most timeout for a report from the keyboard. Completion callbacks and futures of
+   * the *_async functions are only served from inside this function (which is also used by all
+   * blocking calls). Returns true if there are still unfinished commands.
+   */
+  bool poll(std::chrono::milliseconds timeout = {}) {
+    try {
+      check_connection();
+      expire();
+      fill_pipeline();
+      transport_->reap();
+      if (input->thread.joinable()) {
+        if (input->available.try_acquire_for(timeout)) take_event();
+      } else {
+        // Leftovers from a stopped event thread
+        while (input->available.try_acquire())
+          take_event();
+        // We allocate 10 bytes even though we only expect 9 bytes. This allows us to detect if
+        // too much data was provided.
+        std::array<std::byte, 10> buffer;
+        if (auto response = input->handle_report(transport_->read(buffer, timeout)))
+          acknowledge(*response);
+      }
+      fill_pipeline();
+    } catch (...) {
+      counters->count_error(std::current_exception());
+      note_failure(std::current_exception());
+      if (transactions.empty()) throw;
+      abort(std::current_exception());
+    }
+    return !transactions.empty();
+  }
+
+  /** Block until all queued commands finished. */
+  void flush() {
+    while (poll(std::chrono::milliseconds(1))) {}
+  }
+
   Status status() {
-    std::array<std::byte, 64> msg = {std::byte(7), std::byte(0x81)};
-    auto response                 = generic_exchange(msg);
-    if (std::byte(0x8) != response[0]) throw ProtocolException(8, response);
-    if (std::byte(0x81) != response[1]) throw ProtocolException(9, response);
+    auto transaction = stage(std::byte(0x81), true);
+    make_block(transaction->add(), std::byte(0x81), std::byte());
+    return to_status(run(transaction));
+  }
 
-    Status status;
-    static_assert(sizeof status + 2 == response.size());
-    memcpy(&status, response.data() + 2, sizeof status);
-    return status;
+  void status_async(StatusCompletion done) {
+    auto transaction = stage(std::byte(0x81), true);
+    make_block(transaction->add(), std::byte(0x81), std::byte());
+    transaction->done = [done = std::move(done)](std::exception_ptr error,
+                                                 const Response &response) {
+      auto status = error ? Status{} : to_status(response);
+      done(std::move(error), status);
+    };
+    submit(transaction);
   }
 
   /**
@@ -244,6 +1299,15 @@ class X50Q {
     assert(index > 0 && index <= 6);
     return set_builtin_(index);
   }
+  void set_builtin_async(std::uint8_t index, Completion done) {
+    assert(index > 0 && index <= 6);
+    auto transaction  = make_transaction(std::byte(0x01), std::byte(index), 0, {});
+    transaction->done = std::move(done);
+    submit(transaction);
+  }
+
+  // Replicates what the Windows driver does when the keyboard gets connected. Takes seconds.
+  void setup();
 
   /** Change the idle color
    *
@@ -255,6 +1319,12 @@ class X50Q {
   void apply_colors_idle(std::span<const std::uint8_t[144]> data = {}) {
     exchange(std::byte(0x09), std::byte(0x06), 3 * 144, as_bytes(data));
   }
+  std::future<void> apply_colors_idle_async(std::span<const std::uint8_t[144]> data = {}) {
+    return exchange_async(std::byte(0x09), std::byte(0x06), 3 * 144, as_bytes(data));
+  }
+  void apply_colors_idle_async(std::span<const std::uint8_t[144]> data, Completion done) {
+    exchange_async(std::byte(0x09), std::byte(0x06), 3 * 144, as_bytes(data), std::move(done));
+  }
 
   /** Change the color used after the key is pressed.
    *
@@ -263,21 +1333,162 @@ class X50Q {
   void apply_colors_active(std::span<const std::uint8_t[144]> data = {}) {
     exchange(std::byte(0x0a), std::byte(0x06), 3 * 144, as_bytes(data));
   }
+  std::future<void> apply_colors_active_async(std::span<const std::uint8_t[144]> data = {}) {
+    return exchange_async(std::byte(0x0a), std::byte(0x06), 3 * 144, as_bytes(data));
+  }
+  void apply_colors_active_async(std::span<const std::uint8_t[144]> data, Completion done) {
+    exchange_async(std::byte(0x0a), std::byte(0x06), 3 * 144, as_bytes(data), std::move(done));
+  }
 
   /** Change the effects used after the key is pressed. Upto 144 effects can be provided. */
   void apply_effects_idle(std::span<const Effect> data = {}) {
     exchange(std::byte(0x0d), std::byte(0x06), 144, as_bytes(data));
   }
+  std::future<void> apply_effects_idle_async(std::span<const Effect> data = {}) {
+    return exchange_async(std::byte(0x0d), std::byte(0x06), 144, as_bytes(data));
+  }
+  void apply_effects_idle_async(std::span<const Effect> data, Completion done) {
+    exchange_async(std::byte(0x0d), std::byte(0x06), 144, as_bytes(data), std::move(done));
+  }
 
   /** Change the effects used after the key is pressed. Upto 144 effects can be provided. */
   void apply_effects_active(std::span<const Effect> data = {}) {
     exchange(std::byte(0x0e), std::byte(0x06), 144, as_bytes(data));
   }
+  std::future<void> apply_effects_active_async(std::span<const Effect> data = {}) {
+    return exchange_async(std::byte(0x0e), std::byte(0x06), 144, as_bytes(data));
+  }
+  void apply_effects_active_async(std::span<const Effect> data, Completion done) {
+    exchange_async(std::byte(0x0e), std::byte(0x06), 144, as_bytes(data), std::move(done));
+  }
 
   /** Change the effects used after the key is pressed. Upto 144 effects can be provided. */
   void apply_active_duration(std::span<const std::chrono::duration<std::uint8_t>> data = {}) {
     exchange(std::byte(0x0f), std::byte(0x06), 144, as_bytes(data));
   }
+  std::future<void>
+  apply_active_duration_async(std::span<const std::chrono::duration<std::uint8_t>> data = {}) {
+    return exchange_async(std::byte(0x0f), std::byte(0x06), 144, as_bytes(data));
+  }
+  void apply_active_duration_async(std::span<const std::chrono::duration<std::uint8_t>> data,
+                                   Completion done) {
+    exchange_async(std::byte(0x0f), std::byte(0x06), 144, as_bytes(data), std::move(done));
+  }
+
+  /** Upload only some blocks of a table.
+   *
+   * data has to contain the whole table (or a prefix of it, the rest is filled with zeros), but
+   * only the blocks selected in blocks get sent. Block i contains bytes 60*i to 60*i+59.
+   */
+  void apply_blocks(Table table, std::span<const std::byte> data,
+                    BlockMask blocks = BlockMask().set()) {
+    run(make_transaction(std::byte(table), std::byte(0x06), table_size(table), data, blocks));
+  }
+  void apply_blocks_async(Table table, std::span<const std::byte> data, BlockMask blocks,
+                          Completion done) {
+    auto transaction =
+        make_transaction(std::byte(table), std::byte(0x06), table_size(table), data, blocks);
+    transaction->done = std::move(done);
+    submit(transaction);
+  }
+
+  /** A table stored as the packets which upload it.
+   *
+   * The packet headers are written once and the table is written straight into the packets, so
+   * apply() sends them without copying anything. Color tables can be indexed like the arrays
+   * taken by apply_colors_idle: fb[channel][key]. A framebuffer has to stay alive and unchanged
+   * until its upload finished, animations should alternate between two of them.
+   */
+  class Framebuffer {
+    friend class X50Q;
+    Table table_;
+    std::array<Packet, max_blocks> packets = {};
+
+   public:
+    // One color channel of a color table
+    class Channel {
+      Framebuffer &framebuffer;
+      std::size_t offset;
+
+     public:
+      Channel(Framebuffer &framebuffer, std::size_t offset):
+          framebuffer(framebuffer), offset(offset) {}
+      std::uint8_t &operator[](std::size_t key) const {
+        assert(key < 144);
+        return framebuffer.byte(offset + key);
+      }
+    };
+
+    explicit Framebuffer(Table table): table_(table) {
+      for (std::size_t i = 0; i != blocks(); ++i)
+        make_block(packets[i], std::byte(table), std::byte(0x06), i);
+    }
+
+    Table table() const { return table_; }
+    std::size_t size() const { return table_size(table_); }
+    std::size_t blocks() const { return (size() + 59) / 60; }
+
+    // Byte i of the table
+    std::uint8_t &byte(std::size_t i) {
+      assert(i < size());
+      return reinterpret_cast<std::uint8_t &>(packets[i / 60][4 + i % 60]);
+    }
+    std::uint8_t byte(std::size_t i) const {
+      assert(i < size());
+      return std::uint8_t(packets[i / 60][4 + i % 60]);
+    }
+
+    // Channel 0 is red, 1 green and 2 blue
+    Channel operator[](std::size_t channel) {
+      assert(size() == 3 * 144 && channel < 3);
+      return Channel(*this, 144 * channel);
+    }
+    void set_color(std::uint8_t key, std::uint8_t r, std::uint8_t g, std::uint8_t b) {
+      (*this)[0][key] = r;
+      (*this)[1][key] = g;
+      (*this)[2][key] = b;
+    }
+    void set_effect(std::uint8_t key, Effect effect) { byte(key) = std::uint8_t(effect); }
+    void set_active_duration(std::uint8_t key, ByteSeconds duration) {
+      byte(key) = duration.count();
+    }
+
+    // Overwrite the start of the table, e.g. with a whole table in the format of apply_blocks
+    void assign(std::span<const std::byte> data) {
+      assert(data.size() <= size());
+      for (std::size_t offset = 0; offset < data.size(); offset += 60) {
+        auto chunk = data.subspan(offset, std::min<std::size_t>(60, data.size() - offset));
+        std::ranges::copy(chunk, packets[offset / 60].begin() + 4);
+      }
+    }
+
+    // The blocks which differ from other, e.g. the frame shown before
+    BlockMask changed(const Framebuffer &other) const {
+      assert(table_ == other.table_);
+      BlockMask result;
+      for (std::size_t i = 0; i != blocks(); ++i)
+        result[i] = packets[i] != other.packets[i];
+      return result;
+    }
+  };
+
+  // Upload the selected blocks of a framebuffer, straight from its packets.
+  void apply(const Framebuffer &framebuffer, BlockMask blocks = BlockMask().set()) {
+    run(make_transaction(framebuffer, blocks));
+  }
+  void apply_async(const Framebuffer &framebuffer, BlockMask blocks, Completion done) {
+    auto transaction  = make_transaction(framebuffer, blocks);
+    transaction->done = std::move(done);
+    submit(transaction);
+  }
+
+ private:
+  TransactionRef make_transaction(const Framebuffer &framebuffer, BlockMask selected) {
+    auto transaction = stage(std::byte(framebuffer.table_), false);
+    for (std::size_t i = 0; i != framebuffer.blocks(); ++i)
+      if (selected[i]) transaction->add(framebuffer.packets[i]);
+    return transaction;
+  }
 };
 
 // Not sure if this is useful for anything. It replicates what the Windows program does when the
@@ -0,0 +1,200 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef X50Q_X50QD_HPP
+#define X50Q_X50QD_HPP
+#include "shadow.hpp"
+#include "x50q.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <optional>
+#include <poll.h>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+/** Protocol of the x50qd daemon.
+ *
+ * Clients connect to a SOCK_SEQPACKET Unix socket, so every message arrives as a whole. A request
+ * starts with the Command byte followed by its fixed size payload. Every request gets exactly
+ * one reply: the command byte, an Error byte and, depending on the command, the status or an
+ * error message. After Subscribe, notifications from the keyboard are sent as additional
+ * messages starting with an Event byte.
+ */
+namespace mfk::x50qd {
+enum class Command : std::uint8_t {
+  SetKey      = 1, // Table, key index, r, g, b
+  SetFrame    = 2, // Table, 3 * 144 colors
+  ApplyTables = 3, // ShadowState::Tables
+  SetBuiltin  = 4, // Profile index (1 to 6)
+  Status      = 5, // Reply contains X50Q::Status
+  Subscribe   = 6,
+  Invalidate  = 7, // Forget what is on the keyboard, the next change uploads every block
+};
+enum class Error : std::uint8_t {
+  None     = 0,
+  Invalid  = 1, // Malformed request
+  Keyboard = 2, // The keyboard didn't accept the command. Followed by the message.
+};
+// Values have the top bit set to keep them apart from Command.
+enum class Event : std::uint8_t {
+  ProfileChange = 0x81, // New profile
+  VolumeKey     = 0x82, // 1 if turned up, 0 if turned down
+};
+
+inline constexpr std::size_t max_message = 1 + sizeof(ShadowState::Tables);
+
+inline std::string socket_path() {
+  auto runtime = std::getenv("XDG_RUNTIME_DIR");
+  return runtime && *runtime ? std::string(runtime) + "/x50qd.socket" : "/run/x50qd.socket";
+}
+
+inline sockaddr_un socket_address(const std::string &path) {
+  sockaddr_un address = {};
+  address.sun_family  = AF_UNIX;
+  if (path.size() >= sizeof address.sun_path) throw std::invalid_argument("Socket path too long");
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+/** Connection to a running x50qd.
+ *
+ * The functions block until the daemon replied and throw a std::runtime_error if the keyboard
+ * failed. The constructor throws a std::system_error if no daemon is running.
+ */
+class Client {
+  int fd;
+  std::deque<std::pair<Event, std::uint8_t>> events;
+
+  std::vector<std::byte> request(Command command, std::span<const std::byte> payload = {}) {
+    std::byte message[max_message];
+    message[0] = std::byte(command);
+    std::ranges::copy(payload, message + 1);
+    if (::send(fd, message, 1 + payload.size(), MSG_NOSIGNAL) < 0)
+      throw std::system_error(errno, std::generic_category(), "x50qd");
+    while (true) {
+      std::vector<std::byte> reply(max_message);
+      auto length = receive(reply, -1);
+      if (length >= 2 && reply[0] == std::byte(command)) {
+        reply.resize(length);
+        if (Error(reply[1]) == Error::None) return reply;
+        if (Error(reply[1]) == Error::Invalid) throw std::runtime_error("x50qd: Invalid request");
+        throw std::runtime_error(fmt::format(
+            "x50qd: {}", std::string_view(reinterpret_cast<const char *>(&reply[2]), length - 2)));
+      }
+    }
+  }
+
+  // Returns the length of the message, or zero if it was an event (which gets queued) or nothing
+  // arrived before the timeout.
+  std::size_t receive(std::span<std::byte> buffer, int timeout_ms) {
+    while (true) {
+      pollfd pfd{fd, POLLIN, 0};
+      int ready = ::poll(&pfd, 1, timeout_ms);
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready < 0) throw std::system_error(errno, std::generic_category(), "x50qd");
+      if (!ready) return 0;
+      auto length = ::recv(fd, buffer.data(), buffer.size(), 0);
+      if (length < 0) throw std::system_error(errno, std::generic_category(), "x50qd");
+      if (!length) throw std::runtime_error("x50qd closed the connection");
+      if (length == 2 && (std::uint8_t(buffer[0]) & 0x80)) {
+        events.emplace_back(Event(buffer[0]), std::uint8_t(buffer[1]));
+        return 0;
+      }
+      return length;
+    }
+  }
+
+ public:
+  explicit Client(const std::string &path = socket_path()):
+      fd(::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) {
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "socket");
+    auto address = socket_address(path);
+    if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof address)) {
+      auto error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+  }
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+  ~Client() { ::close(fd); }
+
+  void set_key(X50Q::Table table, std::uint8_t key, std::uint8_t r, std::uint8_t g,
+               std::uint8_t b) {
+    const std::uint8_t payload[] = {std::uint8_t(table), key, r, g, b};
+    request(Command::SetKey, std::as_bytes(std::span(payload)));
+  }
+  void set_frame(X50Q::Table table, const std::uint8_t (&colors)[3][144]) {
+    std::byte payload[1 + sizeof colors];
+    payload[0] = std::byte(table);
+    std::memcpy(payload + 1, colors, sizeof colors);
+    request(Command::SetFrame, payload);
+  }
+  // Only blocks which differ from what the daemon uploaded last are sent to the keyboard.
+  void apply_tables(const ShadowState::Tables &tables) {
+    request(Command::ApplyTables, std::as_bytes(std::span(&tables, 1)));
+  }
+  // Make the next apply_tables upload everything, e.g. if the keyboard was changed by someone else.
+  void invalidate() { request(Command::Invalidate); }
+  void set_builtin(std::uint8_t index) {
+    const std::byte payload[] = {std::byte(index)};
+    request(Command::SetBuiltin, payload);
+  }
+  X50Q::Status status() {
+    auto reply = request(Command::Status);
+    X50Q::Status status;
+    if (reply.size() != 2 + sizeof status) throw std::runtime_error("x50qd: Invalid reply");
+    std::memcpy(&status, &reply[2], sizeof status);
+    return status;
+  }
+
+  // Start receiving events, see next_event.
+  void subscribe() { request(Command::Subscribe); }
+  // Wait at most timeout for the next event. A negative timeout waits forever.
+  std::optional<std::pair<Event, std::uint8_t>>
+  next_event(std::chrono::milliseconds timeout = std::chrono::milliseconds(-1)) {
+    std::byte buffer[max_message];
+    if (events.empty()) receive(buffer, timeout.count() < 0 ? -1 : int(timeout.count()));
+    if (events.empty()) return std::nullopt;
+    auto event = events.front();
+    events.pop_front();
+    return event;
+  }
+};
+} // namespace mfk::x50qd
+#endif
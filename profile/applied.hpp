@@ -0,0 +1,134 @@
+#ifndef X50Q_APPLIED_HPP
+#define X50Q_APPLIED_HPP
+#include "profile.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <span>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+
+/** Remembers what was applied to a keyboard, so applying the same profile again is free.
+ *
+ * For every 60 byte block of every table, a hash of the last upload is kept in a small file in
+ * the runtime directory ($XDG_RUNTIME_DIR/x50q or /run/x50q), named after the USB port of the
+ * keyboard. apply() only sends the blocks whose hash changed.
+ *
+ * The keyboard can't be queried, so this is a guess: The state is dropped when the keyboard got
+ * reconnected (its USB address changed) or when a different profile is active, but changes made
+ * by other programs go unnoticed. Use forget() (or apply_profile --force) in that case.
+ */
+class AppliedState {
+ public:
+  static constexpr std::size_t blocks = 8 + 8 + 3 + 3 + 3;
+
+ private:
+  struct Stored {
+    std::uint32_t version = 0x00010000;
+    std::uint8_t address  = 0;
+    std::uint8_t profile  = 0;
+    std::uint8_t reserved[2] = {};
+    // Zero means unknown. Ordered like Profile::apply.
+    std::array<std::uint64_t, blocks> hashes = {};
+  };
+
+  mfk::X50Q &device;
+  std::string path; // Empty if the keyboard has no stable location
+  Stored stored;
+
+  static std::uint64_t hash(mfk::X50Q::Table table, std::span<const std::byte> block) {
+    std::uint64_t hash = 0xcbf29ce484222325 ^ std::uint8_t(table);
+    for (auto byte : block) {
+      hash ^= std::uint8_t(byte);
+      hash *= 0x100000001b3;
+    }
+    return hash ? hash : 1;
+  }
+
+  void save() {
+    if (path.empty()) return;
+    auto temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+    if (!file.write(reinterpret_cast<const char *>(&stored), sizeof stored).flush()) return;
+    file.close();
+    std::rename(temporary.c_str(), path.c_str());
+  }
+
+ public:
+  // Loads the state of the keyboard. Queries the active profile, which takes a single round trip.
+  explicit AppliedState(mfk::X50Q &device): device(device) {
+    stored.address = device.usb_address();
+    stored.profile = device.status().profile;
+    if (device.location().empty()) return;
+    auto dir = mfk::runtime_directory();
+    // Without a place to keep the state, every apply() sends everything.
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) return;
+    path = fmt::format("{}/{}", dir, device.location());
+
+    Stored loaded;
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read(reinterpret_cast<char *>(&loaded), sizeof loaded) || file.peek() != EOF)
+      return;
+    if (loaded.version != stored.version || loaded.address != stored.address ||
+        loaded.profile != stored.profile)
+      return;
+    stored.hashes = loaded.hashes;
+  }
+
+  // Make the next apply() send everything.
+  void forget() {
+    stored.hashes = {};
+    save();
+  }
+
+  /** Upload all blocks of profile which differ from the last one applied.
+   *
+   * All changed blocks are queued at once and pipelined. Returns the number of blocks sent.
+   */
+  std::size_t apply(const Profile &profile) {
+    const std::pair<mfk::X50Q::Table, std::span<const std::byte>> tables[] = {
+        {mfk::X50Q::Table::ActiveDuration, as_bytes(std::span(profile.active_duration))},
+        {mfk::X50Q::Table::EffectsActive, as_bytes(std::span(profile.effects_active))},
+        {mfk::X50Q::Table::ColorsActive, as_bytes(std::span(profile.colors_active))},
+        {mfk::X50Q::Table::EffectsIdle, as_bytes(std::span(profile.effects_idle))},
+        {mfk::X50Q::Table::ColorsIdle, as_bytes(std::span(profile.colors_idle))}};
+
+    std::exception_ptr first_error;
+    // Outlive the completions (until flush()), which only reference them to stay small
+    std::array<std::array<std::uint64_t, 8>, std::size(tables)> table_hashes = {};
+    std::size_t sent = 0, first_block = 0, index = 0;
+    for (auto [table, data] : tables) {
+      mfk::X50Q::BlockMask changed;
+      auto &hashes      = table_hashes[index++];
+      std::size_t count = (data.size() + 59) / 60;
+      for (std::size_t i = 0; i != count; ++i) {
+        auto block = data.subspan(60 * i, std::min<std::size_t>(60, data.size() - 60 * i));
+        hashes[i]  = hash(table, block);
+        if (hashes[i] != stored.hashes[first_block + i]) changed.set(i);
+      }
+      sent += changed.count();
+      if (changed.any()) {
+        device.apply_blocks_async(
+            table, data, changed,
+            [this, &hashes, count, first_block, &first_error](std::exception_ptr error,
+                                                              const mfk::X50Q::Response &) {
+              for (std::size_t i = 0; i != count; ++i)
+                stored.hashes[first_block + i] = error ? 0 : hashes[i];
+              if (error && !first_error) first_error = std::move(error);
+            });
+      }
+      first_block += count;
+    }
+    device.flush();
+    save();
+    if (first_error) std::rethrow_exception(first_error);
+    return sent;
+  }
+};
+#endif
@@ -1,27 +1,86 @@
+#include "applied.hpp"
+#include "library.hpp"
 #include "profile.hpp"
+#include "x50qd.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <string_view>
 
-int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    fmt::print("Usage: {} <file name>\n", argv[0]);
+int main(int argc, char *argv[]) try {
+  // Without --force, blocks which are already on the keyboard are skipped, see AppliedState.
+  // --direct talks to the keyboard even if x50qd is running.
+  const char *program = argv[0];
+  bool force = false, direct = false, usage = false;
+  for (; argc > 1 && std::string_view(argv[1]).starts_with("--"); --argc, ++argv) {
+    if (std::string_view(argv[1]) == "--force")
+      force = true;
+    else if (std::string_view(argv[1]) == "--direct")
+      direct = true;
+    else
+      usage = true;
+  }
+  if (usage || argc < 2 || argc > 3) {
+    fmt::print("Usage: {0} [--force] [--direct] <file name>\n"
+               "       {0} [--force] [--direct] <library> <profile name>\n",
+               program);
     return -1;
   }
-  Profile profile;
-  {
+  Profile loaded;
+  // A profile from a library is used in place, without copying it out of the mapping.
+  std::optional<ProfileLibrary> library;
+  const Profile *profile = &loaded;
+  if (argc == 3) {
+    try {
+      library.emplace(argv[1]);
+    } catch (const std::exception &ex) {
+      fmt::print(stderr, "Unable to read library: {}", ex.what());
+      return 1;
+    }
+    profile = library->find(argv[2]);
+    if (!profile) {
+      fmt::print(stderr, "Unknown profile");
+      return 3;
+    }
+  } else {
     std::ifstream file(argv[1]);
-    if (!(file >> profile)) {
+    if (!(file >> loaded)) {
       fmt::print(stderr, "Unable to read profile");
       return 1;
     }
-    if ((profile.version & 0xFFFF0000U) != 0x00010000) {
-      fmt::print(stderr, "Unsupported profile version");
-      return 2;
+  }
+  if ((profile->version & 0xFFFF0000U) != 0x00010000) {
+    fmt::print(stderr, "Unsupported profile version");
+    return 2;
+  }
+  // A running x50qd owns the keyboard, so let it do the upload.
+  if (!direct) {
+    std::optional<mfk::x50qd::Client> daemon;
+    try {
+      daemon.emplace();
+    } catch (const std::system_error &) {}
+    if (daemon) {
+      mfk::ShadowState::Tables tables;
+      std::ranges::copy(profile->active_duration, tables.active_duration);
+      std::ranges::copy(profile->effects_active, tables.effects_active);
+      std::memcpy(tables.colors_active, profile->colors_active, sizeof tables.colors_active);
+      std::ranges::copy(profile->effects_idle, tables.effects_idle);
+      std::memcpy(tables.colors_idle, profile->colors_idle, sizeof tables.colors_idle);
+      if (force) daemon->invalidate();
+      daemon->apply_tables(tables);
+      return 0;
     }
   }
   mfk::X50Q x50q;
-  profile.apply(x50q);
+  AppliedState state(x50q);
+  if (force) state.forget();
+  state.apply(*profile);
   return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return -1;
 }
@@ -1,205 +1,99 @@
+#include "applied.hpp"
+#include "layout.hpp"
 #include "profile.hpp"
 #include "x50q.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
 #include <charconv>
 #include <fmt/format.h>
 #include <fstream>
-#include <iostream>
-#include <sstream>
-#include <type_traits>
-#include <unordered_map>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
 
-const std::unordered_map<std::string, std::uint8_t> key_mapping = {
-    {"'", 66},
-    {",", 85},
-    {"-", 72},
-    {".", 86},
-    {"/", 76},
-    {"0", 81},
-    {"1", 37},
-    {"2", 28},
-    {"3", 19},
-    {"4", 10},
-    {"5", 15},
-    {"6", 1},
-    {"7", 6},
-    {"8", 91},
-    {"9", 96},
-    {";", 74},
-    {"=", 64},
-    {"[", 65},
-    {"\\", 56},
-    {"]", 69},
-    {"`", 46},
-    {"a", 39},
-    {"b", 13},
-    {"backspace", 60},
-    {"c", 24},
-    {"caps_lock", 48},
-    {"d", 21},
-    {"del", 101},
-    {"down", 137},
-    {"e", 20},
-    {"end", 103},
-    {"enter", 58},
-    {"esc", 45},
-    {"f", 25},
-    {"f1", 27},
-    {"f10", 63},
-    {"f11", 68},
-    {"f12", 54},
-    {"f2", 18},
-    {"f3", 9},
-    {"f4", 14},
-    {"f5", 0},
-    {"f6", 5},
-    {"f7", 90},
-    {"f8", 95},
-    {"f9", 77},
-    {"fn", 79},
-    {"forward", 129},
-    {"g", 12},
-    {"h", 3},
-    {"home", 105},
-    {"i", 82},
-    {"ins", 61},
-    {"j", 93},
-    {"k", 83},
-    {"l", 84},
-    {"left", 140},
-    {"left_alt", 32},
-    {"left_ctrl", 50},
-    {"left_light_bottom", 42},
-    {"left_light_top", 36},
-    {"left_shift", 49},
-    {"light", 111},
-    {"m", 94},
-    {"menu", 78},
-    {"meta", 41},
-    {"n", 4},
-    {"num", 102},
-    {"num_0", 141},
-    {"num_1", 136},
-    {"num_2", 109},
-    {"num_3", 127},
-    {"num_4", 139},
-    {"num_5", 112},
-    {"num_6", 130},
-    {"num_7", 142},
-    {"num_8", 115},
-    {"num_9", 133},
-    {"num_divide", 110},
-    {"num_dot", 132},
-    {"num_enter", 121},
-    {"num_minus", 119},
-    {"num_mult", 128},
-    {"num_plus", 124},
-    {"o", 87},
-    {"p", 73},
-    {"page_down", 100},
-    {"page_up", 106},
-    {"pause", 104},
-    {"play", 120},
-    {"print", 59},
-    {"q", 38},
-    {"r", 11},
-    {"right", 138},
-    {"right_alt", 88},
-    {"right_ctrl", 67},
-    {"right_light_bottom", 51},
-    {"right_light_top", 123},
-    {"right_shift", 70},
-    {"s", 30},
-    {"scrlk", 99},
-    {"space", 23},
-    {"t", 16},
-    {"tab", 47},
-    {"u", 92},
-    {"up", 135},
-    {"v", 22},
-    {"volume_bottom_left", 131},
-    {"volume_bottom_right", 118},
-    {"volume_top_left", 117},
-    {"volume_top_right", 126},
-    {"w", 29},
-    {"x", 33},
-    {"y", 2},
-    {"z", 31},
-};
+// Splits the input into words separated by white space without allocating. Reads directly from
+// the file descriptor, so interactive input gets handled as soon as a line is complete.
+class Tokenizer {
+  int fd;
+  std::array<char, 1 << 16> buffer;
+  std::size_t begin = 0, end = 0;
+  bool eof          = false;
+
+  static bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
 
-std::istream &operator>>(std::istream &stream, mfk::X50Q::Effect &effect) {
-  std::string name;
-  stream >> name;
-  if (name == "set-color")
-    effect = mfk::X50Q::Effect::SetColor;
-  else if (name == "breadth")
-    effect = mfk::X50Q::Effect::Breadth;
-  else if (name == "blink")
-    effect = mfk::X50Q::Effect::Blink;
-  else if (name == "cycle")
-    effect = mfk::X50Q::Effect::Cycle;
-  else if (name == "inwards-ripple")
-    effect = mfk::X50Q::Effect::InwardsRipple;
-  else if (name == "ripple")
-    effect = mfk::X50Q::Effect::Ripple;
-  else if (name == "laser")
-    effect = mfk::X50Q::Effect::Laser;
-  else {
-    fmt::print(stderr, "Unknown effect. The supported effects are 'set-color', 'breadth', 'blink', "
-                       "'cycle', 'inwards-ripple', 'ripple' and 'laser'.\n");
-    std::exit(10);
+  void fill() {
+    // Keep the start of a word which got cut off
+    std::copy(buffer.data() + begin, buffer.data() + end, buffer.data());
+    end -= begin;
+    begin = 0;
+    if (end == buffer.size()) throw std::runtime_error("Word too long");
+    ssize_t count;
+    do
+      count = ::read(fd, buffer.data() + end, buffer.size() - end);
+    while (count < 0 && errno == EINTR);
+    if (count < 0) throw std::system_error(errno, std::generic_category());
+    if (count == 0) eof = true;
+    end += count;
   }
-  return stream;
-}
 
-void read_rgb(std::span<std::uint8_t[144], 3> buffer, std::uint8_t index, std::istream &stream) {
-  std::string color_str;
-  stream >> color_str;
-  std::uint8_t r, g, b;
-  auto color = color_str.c_str();
-  if (color_str.size() == 3) {
-    auto result = std::from_chars(color, color + 1, r, 16);
-    if (result.ptr != color + 1) {
-      fmt::print(stderr, "Unable to parse red component\n");
-      std::exit(11);
-    }
-    r *= 17;
-    result = std::from_chars(color + 1, color + 2, g, 16);
-    if (result.ptr != color + 2) {
-      fmt::print(stderr, "Unable to parse green component\n");
-      std::exit(11);
-    }
-    g *= 17;
-    result = std::from_chars(color + 2, color + 3, b, 16);
-    if (result.ptr != color + 3) {
-      fmt::print(stderr, "Unable to parse green component\n");
-      std::exit(11);
-    }
-    b *= 17;
-  } else if (color_str.size() == 6) {
-    auto result = std::from_chars(color, color + 2, r, 16);
-    if (result.ptr != color + 2) {
-      fmt::print(stderr, "Unable to parse red component\n");
-      std::exit(11);
-    }
-    result = std::from_chars(color + 2, color + 4, g, 16);
-    if (result.ptr != color + 4) {
-      fmt::print(stderr, "Unable to parse green component\n");
-      std::exit(11);
-    }
-    result = std::from_chars(color + 4, color + 6, b, 16);
-    if (result.ptr != color + 6) {
-      fmt::print(stderr, "Unable to parse green component\n");
-      std::exit(11);
+ public:
+  explicit Tokenizer(int fd): fd(fd) {}
+
+  // The next word, empty at the end of the input. Only valid until the next call.
+  std::string_view next() {
+    while (true) {
+      auto first = std::find_if_not(buffer.data() + begin, buffer.data() + end, is_space);
+      auto last  = std::find_if(first, buffer.data() + end, is_space);
+      begin      = first - buffer.data();
+      // A word is complete once it is followed by white space or the input ended.
+      if (first != last && (last != buffer.data() + end || eof)) {
+        begin = last - buffer.data();
+        return {first, std::size_t(last - first)};
+      }
+      if (eof) return {};
+      fill();
     }
-  } else {
+  }
+};
+
+std::optional<mfk::X50Q::Effect> parse_effect(std::string_view name) {
+  if (name == "set-color") return mfk::X50Q::Effect::SetColor;
+  if (name == "breadth") return mfk::X50Q::Effect::Breadth;
+  if (name == "blink") return mfk::X50Q::Effect::Blink;
+  if (name == "cycle") return mfk::X50Q::Effect::Cycle;
+  if (name == "inwards-ripple") return mfk::X50Q::Effect::InwardsRipple;
+  if (name == "ripple") return mfk::X50Q::Effect::Ripple;
+  if (name == "laser") return mfk::X50Q::Effect::Laser;
+  return std::nullopt;
+}
+
+template <typename T> std::optional<T> parse_number(std::string_view word, int base = 10) {
+  T value;
+  auto result = std::from_chars(word.data(), word.data() + word.size(), value, base);
+  if (result.ec != std::errc() || result.ptr != word.data() + word.size()) return std::nullopt;
+  return value;
+}
+
+// Colors are given as RGB or RRGGBB in hex.
+bool read_rgb(std::span<std::uint8_t[144], 3> buffer, std::uint8_t index, std::string_view color) {
+  if (color.size() != 3 && color.size() != 6) {
     fmt::print(stderr, "Unable to parse color\n");
-    std::exit(11);
+    return false;
   }
-  buffer[0][index] = r;
-  buffer[1][index] = g;
-  buffer[2][index] = b;
+  constexpr std::string_view components[] = {"red", "green", "blue"};
+  auto digits = color.size() / 3;
+  for (std::size_t i = 0; i != 3; ++i) {
+    auto value = parse_number<std::uint8_t>(color.substr(i * digits, digits), 16);
+    if (!value) {
+      fmt::print(stderr, "Unable to parse {} component\n", components[i]);
+      return false;
+    }
+    buffer[i][index] = digits == 1 ? *value * 17 : *value;
+  }
+  return true;
 }
 
 int main(int argc, char *argv[]) {
@@ -219,69 +113,66 @@ int main(int argc, char *argv[]) {
       return 2;
     }
   }
-  profile.version  = 0x00010000;
+  profile.version = 0x00010000;
+
+  // The keyboard is opened by the first apply and then kept open. Every apply only sends the
+  // blocks which changed since the previous one.
+  std::optional<mfk::X50Q> x50q;
+  std::optional<AppliedState> applied;
+
+  Tokenizer input(STDIN_FILENO);
   std::uint8_t key = 255;
-  std::string operation;
-  while (std::cin >> operation) {
+  for (auto operation = input.next(); !operation.empty(); operation = input.next()) {
     if (operation == "apply") {
-      mfk::X50Q x50q;
-      profile.apply(x50q);
-    } else if (operation == "save") {
-      std::ofstream file(argv[1]);
-      if (!(file << profile)) {
-        fmt::print(stderr, "Unable to write profile");
-        return 1;
+      if (!x50q) {
+        x50q.emplace();
+        applied.emplace(*x50q);
       }
-    } else if (operation == "quit") {
+      applied->apply(profile);
+    } else if (operation == "save" || operation == "quit") {
       std::ofstream file(argv[1]);
       if (!(file << profile)) {
         fmt::print(stderr, "Unable to write profile");
         return 1;
       }
     } else if (operation == "key") {
-      unsigned int num;
-      std::cin >> num;
-      if (num >= 144) {
+      auto num = parse_number<unsigned>(input.next());
+      if (!num || *num >= 144) {
         fmt::print(stderr, "Invalid keycode provided\n");
         return 3;
-      } else
-        key = num;
+      }
+      key = *num;
     } else if (operation == "name") {
-      std::string name;
-      std::cin >> name;
-      auto iter = key_mapping.find(name);
-      if (key_mapping.end() == iter) {
+      // The UK layout contains all keys of the US layout.
+      auto found = mfk::uk_layout.find(input.next());
+      if (!found) {
         fmt::print(stderr, "Unknown keyname\n");
         return 3;
-      } else
-        key = iter->second;
+      }
+      key = found->index;
     } else if (key == 255) {
       fmt::print(stderr, "No other commands are allowed until a key has been selected\n");
       return 4;
     } else if (operation == "active-duration") {
-      unsigned int seconds;
-      std::cin >> seconds;
-      if (seconds >= 0x100) {
+      auto seconds = parse_number<unsigned>(input.next());
+      if (!seconds || *seconds >= 0x100) {
         fmt::print(stderr, "Duration must be less than 256 seconds\n");
         return 6;
       }
-      profile.active_duration[key] = mfk::ByteSeconds(seconds);
-    } else if (operation == "active-effect") {
-      mfk::X50Q::Effect effect;
-      std::cin >> effect;
-      profile.effects_active[key] = effect;
-    } else if (operation == "idle-effect") {
-      mfk::X50Q::Effect effect;
-      std::cin >> effect;
-      profile.effects_idle[key] = effect;
-    } else if (operation == "active-effect") {
-      mfk::X50Q::Effect effect;
-      std::cin >> effect;
-      profile.effects_active[key] = effect;
-    } else if (operation == "idle-color") {
-      read_rgb(profile.colors_idle, key, std::cin);
-    } else if (operation == "active-color") {
-      read_rgb(profile.colors_active, key, std::cin);
+      profile.active_duration[key] = mfk::ByteSeconds(*seconds);
+    } else if (operation == "active-effect" || operation == "idle-effect") {
+      auto &effects = operation == "active-effect" ? profile.effects_active : profile.effects_idle;
+      auto effect   = parse_effect(input.next());
+      if (!effect) {
+        fmt::print(stderr,
+                   "Unknown effect. The supported effects are 'set-color', 'breadth', 'blink', "
+                   "'cycle', 'inwards-ripple', 'ripple' and 'laser'.\n");
+        return 10;
+      }
+      effects[key] = *effect;
+    } else if (operation == "idle-color" || operation == "active-color") {
+      auto &colors = operation == "idle-color" ? profile.colors_idle : profile.colors_active;
+      if (!read_rgb(colors, key, input.next())) return 11;
     } else {
       fmt::print(stderr, "Unknown command. The supported commands are 'key', 'name', 'apply', "
                          "'save', 'quit', 'active-duration'. "
@@ -0,0 +1,159 @@
+#ifndef X50Q_LIBRARY_HPP
+#define X50Q_LIBRARY_HPP
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+/** Many named profiles in a single file.
+ *
+ * The file gets mapped into memory and the profiles are used in place, nothing is parsed or
+ * copied. Layout (little endian, like Profile):
+ *
+ *   Header    "X50QLIB" magic, version, number of profiles, size of a profile
+ *   Index     For every profile its name (up to 55 bytes, zero padded) and offset, sorted by name
+ *   Profiles  The Profile structs at their offsets
+ */
+class ProfileLibrary {
+ public:
+  struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t count;
+    std::uint32_t profile_size;
+    std::uint32_t reserved;
+  };
+  struct Entry {
+    char name[56];
+    std::uint64_t offset;
+  };
+  static constexpr char magic[8]         = "X50QLIB";
+  static constexpr std::uint32_t version = 0x00010000;
+  static constexpr std::size_t max_name  = sizeof(Entry::name) - 1;
+  static_assert(sizeof(Header) == 24 && sizeof(Entry) == 64);
+
+ private:
+  struct Unmap {
+    std::size_t size;
+    void operator()(void *ptr) const noexcept { munmap(ptr, size); }
+  };
+  std::unique_ptr<void, Unmap> mapping{nullptr, Unmap{0}};
+  std::span<const std::byte> data;
+  std::span<const Entry> index;
+
+  static std::string_view name_of(const Entry &entry) {
+    return {entry.name, strnlen(entry.name, sizeof entry.name)};
+  }
+
+ public:
+  explicit ProfileLibrary(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), path);
+    struct stat info;
+    if (fstat(fd, &info)) {
+      auto error = errno;
+      ::close(fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    std::size_t size = info.st_size;
+    void *ptr = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    auto error = errno;
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+      if (!size) throw std::runtime_error(fmt::format("{}: Empty file", path));
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    mapping = {ptr, Unmap{size}};
+    data    = {static_cast<const std::byte *>(ptr), size};
+
+    Header header;
+    if (size < sizeof header) throw std::runtime_error("Not a profile library");
+    std::memcpy(&header, data.data(), sizeof header);
+    if (std::memcmp(header.magic, magic, sizeof magic))
+      throw std::runtime_error("Not a profile library");
+    if ((header.version & 0xFFFF0000U) != (version & 0xFFFF0000U) ||
+        header.profile_size != sizeof(Profile))
+      throw std::runtime_error("Unsupported profile library version");
+    if (header.count > (size - sizeof header) / sizeof(Entry))
+      throw std::runtime_error("Truncated profile library");
+    index = {reinterpret_cast<const Entry *>(data.data() + sizeof header), header.count};
+    for (auto &entry : index) {
+      if (entry.offset % alignof(Profile) || entry.offset > size ||
+          size - entry.offset < sizeof(Profile) || entry.name[max_name])
+        throw std::runtime_error("Corrupt profile library");
+    }
+  }
+
+  std::size_t size() const { return index.size(); }
+  std::string_view name(std::size_t i) const { return name_of(index[i]); }
+  const Profile &operator[](std::size_t i) const {
+    return *reinterpret_cast<const Profile *>(data.data() + index[i].offset);
+  }
+  // The profile as stored in the file, e.g. to pass it on without looking at it.
+  std::span<const std::byte, sizeof(Profile)> bytes(std::size_t i) const {
+    return data.subspan(index[i].offset).first<sizeof(Profile)>();
+  }
+
+  // The profile with the given name or nullptr.
+  const Profile *find(std::string_view name) const {
+    auto entry = std::ranges::lower_bound(index, name, {}, name_of);
+    if (entry == index.end() || name_of(*entry) != name) return nullptr;
+    return &(*this)[entry - index.begin()];
+  }
+
+  /** Write a new library with the given profiles.
+   *
+   * The file gets replaced atomically, so a library which is currently mapped (e.g. by a running
+   * apply_profile) stays intact.
+   */
+  static void write(const std::string &path,
+                    std::vector<std::pair<std::string, Profile>> profiles) {
+    std::ranges::sort(profiles, {}, &std::pair<std::string, Profile>::first);
+    for (std::size_t i = 0; i != profiles.size(); ++i) {
+      if (profiles[i].first.size() > max_name || profiles[i].first.find('\0') != std::string::npos)
+        throw std::invalid_argument(fmt::format("Invalid profile name '{}'", profiles[i].first));
+      if (i && profiles[i - 1].first == profiles[i].first)
+        throw std::invalid_argument(fmt::format("Duplicate profile '{}'", profiles[i].first));
+    }
+
+    Header header{};
+    std::memcpy(header.magic, magic, sizeof magic);
+    header.version      = version;
+    header.count        = profiles.size();
+    header.profile_size = sizeof(Profile);
+    std::vector<Entry> entries(profiles.size());
+    std::uint64_t offset = sizeof header + entries.size() * sizeof(Entry);
+    for (std::size_t i = 0; i != profiles.size(); ++i) {
+      std::ranges::copy(profiles[i].first, entries[i].name);
+      entries[i].offset = offset;
+      offset += sizeof(Profile);
+    }
+
+    auto temporary = path + ".tmp";
+    {
+      std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+      file.write(reinterpret_cast<const char *>(&header), sizeof header);
+      file.write(reinterpret_cast<const char *>(entries.data()), entries.size() * sizeof(Entry));
+      for (auto &[name, profile] : profiles)
+        file << profile;
+      if (!file.flush()) throw std::runtime_error(fmt::format("Unable to write {}", temporary));
+    }
+    if (std::rename(temporary.c_str(), path.c_str()))
+      throw std::system_error(errno, std::generic_category(), path);
+  }
+};
+#endif
@@ -17,7 +17,8 @@ struct Profile {
   std::uint8_t colors_active[3][144];
   mfk::X50Q::Effect effects_idle[144];
   std::uint8_t colors_idle[3][144];
-  void apply(mfk::X50Q &x50q) {
+  // Sends all tables. AppliedState::apply skips what is already on the keyboard.
+  void apply(mfk::X50Q &x50q) const {
     x50q.apply_active_duration(active_duration);
     x50q.apply_effects_active(effects_active);
     x50q.apply_colors_active(colors_active);
@@ -0,0 +1,67 @@
+#include "library.hpp"
+
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Everything in the library, or nothing if it doesn't exist yet.
+std::vector<std::pair<std::string, Profile>> load(const char *path) {
+  std::vector<std::pair<std::string, Profile>> profiles;
+  if (access(path, F_OK)) return profiles;
+  ProfileLibrary library(path);
+  for (std::size_t i = 0; i != library.size(); ++i)
+    profiles.emplace_back(library.name(i), library[i]);
+  return profiles;
+}
+
+int main(int argc, char *argv[]) try {
+  std::string_view command = argc >= 3 ? argv[2] : "";
+  if (command == "list" && argc == 3) {
+    ProfileLibrary library(argv[1]);
+    for (std::size_t i = 0; i != library.size(); ++i)
+      fmt::print("{}\n", library.name(i));
+  } else if (command == "add" && argc == 5) {
+    Profile profile;
+    std::ifstream file(argv[4]);
+    if (!(file >> profile)) {
+      fmt::print(stderr, "Unable to read profile\n");
+      return 1;
+    }
+    auto profiles = load(argv[1]);
+    std::erase_if(profiles, [&](auto &entry) { return entry.first == argv[3]; });
+    profiles.emplace_back(argv[3], profile);
+    ProfileLibrary::write(argv[1], std::move(profiles));
+  } else if (command == "remove" && argc == 4) {
+    auto profiles = load(argv[1]);
+    if (!std::erase_if(profiles, [&](auto &entry) { return entry.first == argv[3]; })) {
+      fmt::print(stderr, "Unknown profile\n");
+      return 3;
+    }
+    ProfileLibrary::write(argv[1], std::move(profiles));
+  } else if (command == "extract" && argc == 5) {
+    ProfileLibrary library(argv[1]);
+    auto profile = library.find(argv[3]);
+    if (!profile) {
+      fmt::print(stderr, "Unknown profile\n");
+      return 3;
+    }
+    std::ofstream file(argv[4]);
+    if (!(file << *profile)) {
+      fmt::print(stderr, "Unable to write profile\n");
+      return 1;
+    }
+  } else {
+    fmt::print("Usage: {0} <library> list\n"
+               "       {0} <library> add <name> <profile file>\n"
+               "       {0} <library> remove <name>\n"
+               "       {0} <library> extract <name> <profile file>\n",
+               argv[0]);
+    return -1;
+  }
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return 1;
+}
@@ -0,0 +1,129 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Verifies that the steady state doesn't allocate: once every operation ran a few times, running
+// it again must not call operator new. Exits with a non-zero status otherwise.
+
+#include "../bench/count_allocations.hpp"
+#include "simulator.hpp"
+#include "x50q.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <fmt/format.h>
+#include <functional>
+#include <memory>
+
+using namespace mfk;
+
+int failures = 0;
+
+// Run operation a few times to let buffers grow, then count the allocations of further runs.
+void check(const char *name, const std::function<void(int)> &operation) {
+  constexpr int warmup = 10, runs = 100;
+  for (int i = 0; i != warmup; ++i)
+    operation(i);
+  auto before = allocations.load(std::memory_order_relaxed);
+  for (int i = warmup; i != warmup + runs; ++i)
+    operation(i);
+  auto allocated = allocations.load(std::memory_order_relaxed) - before;
+  fmt::print("{:<24} {} allocations\n", name, allocated);
+  if (allocated) ++failures;
+}
+
+int main() try {
+  auto simulator = std::make_unique<SimulatedX50Q>(
+      SimulatedX50Q::Timing{std::chrono::microseconds(50), std::chrono::microseconds(0)});
+  auto &keyboard = *simulator;
+  X50Q dev(std::move(simulator));
+
+  std::uint8_t colors[3][144]            = {};
+  std::array<X50Q::Effect, 144> effects = {};
+  X50Q::Framebuffer framebuffer(X50Q::Table::ColorsIdle);
+  // Notifications arrive on the event thread once it's running
+  std::atomic<int> profiles = 0, volume = 0;
+  int completed = 0;
+  dev.on_profile_change([&](std::uint8_t) { ++profiles; });
+  dev.on_volume_key([&](bool) { ++volume; });
+  auto done = [&](std::exception_ptr error, const X50Q::Response &) {
+    if (error) std::rethrow_exception(error);
+    ++completed;
+  };
+
+  for (bool event_thread : {false, true}) {
+    if (event_thread) dev.start_event_thread();
+    fmt::print("{} the event thread:\n", event_thread ? "With" : "Without");
+    check("status", [&](int) { dev.status(); });
+    check("set_builtin", [&](int i) { dev.set_builtin(i % 6 + 1); });
+    check("apply_colors_idle", [&](int i) {
+      colors[i % 3][i % 144] = i;
+      dev.apply_colors_idle(colors);
+    });
+    check("apply_effects_active", [&](int) { dev.apply_effects_active(effects); });
+    check("apply_blocks", [&](int) {
+      dev.apply_blocks(X50Q::Table::EffectsIdle, as_bytes(std::span(effects)),
+                       X50Q::BlockMask(1));
+    });
+    check("apply_colors_idle_async", [&](int i) {
+      colors[i % 3][i % 144] = i;
+      dev.apply_colors_idle_async(colors, done);
+      dev.apply_colors_active_async(colors, done);
+      dev.flush();
+    });
+    check("status_async", [&](int) {
+      dev.status_async([&](std::exception_ptr error, X50Q::Status) {
+        if (error) std::rethrow_exception(error);
+        ++completed;
+      });
+      dev.flush();
+    });
+    check("apply framebuffer", [&](int i) {
+      framebuffer[i % 3][i % 144] = i;
+      dev.apply(framebuffer);
+    });
+    check("profile notification", [&](int i) {
+      auto expected = profiles + 1;
+      keyboard.press_profile_key(i % 6 + 1);
+      while (profiles != expected)
+        dev.poll(std::chrono::milliseconds(1));
+    });
+    check("volume notification", [&](int i) {
+      auto expected = volume + 1;
+      keyboard.turn_volume(i % 2);
+      while (volume != expected)
+        dev.poll(std::chrono::milliseconds(1));
+    });
+  }
+  dev.stop_event_thread();
+  if (failures) {
+    fmt::print(stderr, "{} operations allocated\n", failures);
+    return 1;
+  }
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return 1;
+}
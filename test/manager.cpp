@@ -0,0 +1,104 @@
+/*
+  Copyright 2021 Marcel Krueger
+
+  Redistribution and use in source and binary forms, with or without modification,
+  are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+  OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Drives two simulated keyboards from their KeyboardManager workers at the same time, with and
+// without event threads. Built with ThreadSanitizer (see the Makefile), which fails the test on
+// any data race. Exits with a non-zero status if a keyboard ends up with the wrong state.
+
+#include "manager.hpp"
+#include "simulator.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fmt/format.h>
+#include <memory>
+#include <vector>
+
+using namespace mfk;
+
+int main() try {
+  std::vector<std::unique_ptr<Transport>> transports;
+  std::vector<SimulatedX50Q *> keyboards;
+  for (int i = 0; i != 2; ++i) {
+    auto keyboard = std::make_unique<SimulatedX50Q>(SimulatedX50Q::Timing{
+        std::chrono::microseconds(200), std::chrono::microseconds(300)});
+    keyboards.push_back(keyboard.get());
+    transports.push_back(std::move(keyboard));
+  }
+  KeyboardManager manager(std::move(transports));
+
+  int failures = 0;
+  auto check = [&](const std::vector<std::exception_ptr> &errors, const char *what) {
+    for (std::size_t i = 0; i != errors.size(); ++i) {
+      if (!errors[i]) continue;
+      try {
+        std::rethrow_exception(errors[i]);
+      } catch (const std::exception &ex) {
+        fmt::print(stderr, "{} failed on keyboard {}: {}\n", what, i, ex.what());
+      }
+      ++failures;
+    }
+  };
+
+  std::uint8_t frames[2][3][144] = {};
+  for (int round = 0; round != 2; ++round) {
+    auto switched = manager.run_all([round](X50Q &device) {
+      if (round)
+        device.start_event_thread();
+      else
+        device.stop_event_thread();
+    });
+    check(switched, "Switching the event thread");
+    for (int frame = 0; frame != 50; ++frame) {
+      for (int i = 0; i != 2; ++i)
+        for (int key = 0; key != 144; ++key)
+          frames[i][frame % 3][key] = std::uint8_t(frame + key + i);
+      check(manager.present(frames, KeyboardManager::clock::now() + std::chrono::seconds(1)),
+            "present");
+    }
+    auto commands = manager.run_all([](X50Q &device) {
+      for (int i = 0; i != 20; ++i) {
+        device.set_builtin(i % 6 + 1);
+        device.status();
+      }
+    });
+    check(commands, "Commands");
+  }
+
+  for (std::size_t i = 0; i != keyboards.size(); ++i) {
+    auto table = keyboards[i]->table(X50Q::Table::ColorsIdle);
+    if (std::memcmp(table.data(), frames[i], sizeof frames[i])) {
+      fmt::print(stderr, "Keyboard {} shows the wrong frame\n", i);
+      ++failures;
+    }
+  }
+  if (failures) return 1;
+  fmt::print("OK\n");
+  return 0;
+} catch (const std::exception &ex) {
+  fmt::print(stderr, "Error: {}\n", ex.what());
+  return 1;
+}